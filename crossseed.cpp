@@ -0,0 +1,128 @@
+#include "crossseed.h"
+#include "torrentfile.h"
+#include "torrentfileview.h"
+
+bool CrossSeedMatcher::addTorrent(const QString &filename)
+{
+    TorrentFileView v(filename);
+    if (!v.isValid())
+        return false;
+
+    Torrent t;
+    t.filename = filename;
+    QString name = v.getName();
+    TorrentFileView::FileIterator it = v.files();
+    while (it.hasNext())
+    {
+        QPair<QStringList, qint64> f = it.next();
+        f.first.prepend(name);
+        t.paths << f.first;
+        t.lengths << f.second;
+        t.padding << it.isPadding();
+        t.local << QString();
+        t.score << 0;
+    }
+    if (t.paths.isEmpty())
+        return false;
+
+    int idx = m_torrents.size();
+    for (int i = 0; i < t.paths.size(); ++i)
+        if (t.lengths.at(i) && !t.padding.at(i))
+            m_index[QPair<qint64, QString>(t.lengths.at(i), t.paths.at(i).last())] << QPair<int, int>(idx, i);
+    m_torrents << t;
+    return true;
+}
+
+void CrossSeedMatcher::scan(const QString &path)
+{
+    QList<QPair<QString, qint64> > files = TorrentFile::getFilesFromFolder(path);
+    for (auto i = files.constBegin(); i != files.constEnd(); ++i)
+    {
+        QStringList localpath = (*i).first.split('/');
+        auto hit = m_index.constFind(QPair<qint64, QString>((*i).second, localpath.last()));
+        if (hit == m_index.constEnd())
+            continue;
+
+        for (auto x = hit.value().constBegin(); x != hit.value().constEnd(); ++x)
+        {
+            Torrent& t = m_torrents[(*x).first];
+            const QStringList& tpath = t.paths.at((*x).second);
+            int score = 0;
+            while (score < tpath.size() && score < localpath.size() && tpath.at(tpath.size() - score - 1) == localpath.at(localpath.size() - score - 1))
+                ++score;
+            if (score > t.score.at((*x).second))
+            {
+                t.score[(*x).second] = score;
+                t.local[(*x).second] = (*i).first;
+            }
+        }
+    }
+}
+
+QList<CrossSeedMatcher::Match> CrossSeedMatcher::candidates() const
+{
+    QList<Match> res;
+    for (auto i = m_torrents.constBegin(); i != m_torrents.constEnd(); ++i)
+    {
+        Match m;
+        m.torrent = (*i).filename;
+        bool complete = true;
+        for (int x = 0; x < (*i).paths.size() && complete; ++x)
+        {
+            // empty and padding files don't have to exist, the hasher fills in zeros for padding
+            if ((*i).local.at(x).isEmpty() && (*i).lengths.at(x) && !(*i).padding.at(x))
+                complete = false;
+            m.files << QPair<QString, qint64>((*i).local.at(x), (*i).lengths.at(x));
+        }
+        if (!complete)
+            continue;
+
+        for (int x = 0; x < (*i).paths.size(); ++x)
+        {
+            if ((*i).local.at(x).isEmpty())
+                continue;
+            QString rel = (*i).paths.at(x).join("/");
+            QString savepath = (*i).local.at(x).endsWith("/" + rel) ? (*i).local.at(x).chopped(rel.length() + 1) : QString();
+            if (m.savepath.isNull())
+                m.savepath = savepath;
+            if (savepath.isEmpty() || savepath != m.savepath)
+            {
+                m.savepath = "";
+                break;
+            }
+        }
+        res << m;
+    }
+    return res;
+}
+
+bool CrossSeedMatcher::verify(const Match &match, int samples) const
+{
+    TorrentFileView v(match.torrent);
+    if (!v.isValid() || samples < 1)
+        return false;
+
+    qint64 contentlength = 0;
+    for (auto i = match.files.constBegin(); i != match.files.constEnd(); ++i)
+        contentlength += (*i).second;
+    QByteArray pieces = v.getPieces();
+    qint64 piecelength = v.getPieceLength();
+    qint64 n = pieces.size() / 20;
+    if (!piecelength || !n || n != (contentlength + piecelength - 1) / piecelength)
+        return false;
+
+    QList<qint64> indices;
+    if (n <= samples)
+        for (qint64 i = 0; i < n; ++i)
+            indices << i;
+    else
+        for (int i = 0; i < samples; ++i)
+            indices << (samples == 1 ? 0 : i * (n - 1) / (samples - 1));
+
+    TorrentFileHasher h(match.files, piecelength, contentlength);
+    QList<QByteArray> hashes = h.hashPieces(indices);
+    for (int i = 0; i < indices.size(); ++i)
+        if (hashes.at(i) != pieces.mid(indices.at(i) * 20, 20))
+            return false;
+    return true;
+}
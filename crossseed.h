@@ -0,0 +1,52 @@
+#ifndef CROSSSEED_H
+#define CROSSSEED_H
+
+#include <QHash>
+#include <QStringList>
+
+
+//! Finds local data that satisfies existing torrents. The torrents are indexed by (file length, file name) of every file they contain, local files are matched against that index and candidates are confirmed by hashing a few sampled pieces. @sa TorrentFileHasher::hashPieces()
+class CrossSeedMatcher
+{
+public:
+    //! A torrent for which every file has a local candidate.
+    struct Match
+    {
+        QString torrent;
+        //! Directory containing the content under the torrents name. Empty if the local data is named / laid out differently, files has the mapping then.
+        QString savepath;
+        //! The local files in torrent order with the lengths from the torrent.
+        QList<QPair<QString, qint64> > files;
+    };
+
+    //! Reads the file list of a torrent and adds it to the index. @return false if the torrent can't be read.
+    bool addTorrent(const QString& filename);
+    //! Matches all files below path against the index. Can be called for multiple data roots.
+    void scan(const QString& path);
+    //! Returns all torrents for which every file has a local candidate.
+    QList<Match> candidates() const;
+    //! Confirms a candidate by hashing up to samples evenly spread pieces. @return true if all sampled pieces match.
+    bool verify(const Match& match, int samples = 4) const;
+
+    int torrentCount() const {return m_torrents.size();}
+
+private:
+    struct Torrent
+    {
+        QString filename;
+        //! Paths including the torrents name, one per file.
+        QList<QStringList> paths;
+        QList<qint64> lengths;
+        //! BEP 47 padding files, they don't exist on disk.
+        QList<bool> padding;
+        //! Best local candidate per file and the number of trailing path components it shares with the torrent.
+        QStringList local;
+        QList<int> score;
+    };
+
+    QList<Torrent> m_torrents;
+    //! (length, file name) -> (torrent, file)
+    QHash<QPair<qint64, QString>, QList<QPair<int, int> > > m_index;
+};
+
+#endif // CROSSSEED_H
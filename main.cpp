@@ -1,10 +1,16 @@
 #include <QCoreApplication>
 #include <QCommandLineParser>
 #include <QDateTime>
-#include <QJsonDocument>
+#include <QDirIterator>
+#include <QMap>
+#include <QSet>
 #include <QTextStream>
+#include <QThreadPool>
+#include <QTimeZone>
 
+#include "crossseed.h"
 #include "torrentfile.h"
+#include "torrentfileview.h"
 
 #define APPNAME "Simple Torrent Creator"
 #define VERSION "0.0.10"
@@ -27,6 +33,175 @@ QString prettySize(const qint64 &bytes) {
   return QString("%1 %2").arg(res, 0, 'f', 2).arg(l.at(i)).replace(".00", "");
 }
 
+// Parses sizes like "512k", "4m", "500g" or "2t" (binary units) into bytes.
+qint64 parseSize(const QString &size) {
+  static const QString units = "kmgt";
+  // indexOf() finds an empty suffix at 0, which would chop an empty string
+  int unit = size.isEmpty() ? -1 : units.indexOf(size.right(1).toLower());
+  qint64 bytes = (unit < 0 ? size : size.chopped(1)).toLongLong();
+  for (int i = 0; i <= unit; ++i)
+    bytes *= 1024;
+  return bytes;
+}
+
+// Expands directories (recursively, *.torrent) and list files (one path per
+// line, '-' reads the list from stdin) into a list of torrent files.
+QStringList collectTorrentFiles(const QStringList &sources) {
+  QStringList res;
+  for (auto i = sources.constBegin(); i != sources.constEnd(); ++i) {
+    if (QFileInfo((*i)).isDir()) {
+      QDirIterator it((*i), QStringList() << "*.torrent", QDir::Files,
+                      QDirIterator::Subdirectories);
+      while (it.hasNext())
+        res << it.next();
+    } else if ((*i) == "-" || !(*i).endsWith(".torrent", Qt::CaseInsensitive)) {
+      QFile f((*i));
+      if ((*i) == "-" ? !f.open(stdin, QIODevice::ReadOnly)
+                      : !f.open(QIODevice::ReadOnly))
+        continue;
+      QTextStream in(&f);
+      QString line;
+      while (in.readLineInto(&line))
+        if (!line.isEmpty())
+          res << line;
+    } else
+      res << (*i);
+  }
+  return res;
+}
+
+// Hashes all files in parallel and prints groups of torrents with the same
+// info hash ('=') and groups with the same content but a different info hash
+// ('~'), e.g. created by --dupe. Returns 1 if any duplicates were found.
+int bulkHashcompare(const QStringList &files, bool verbose) {
+  QThreadPool pool;
+  pool.setMaxThreadCount(qMax(2, QThread::idealThreadCount()));
+  QList<InspectTask *> tasks;
+  for (qsizetype i = 0; i < files.size(); i += 256) {
+    InspectTask *task = new InspectTask(files.mid(i, 256));
+    tasks << task;
+    pool.start(task);
+  }
+  pool.waitForDone();
+
+  QList<QByteArray> hashorder, contentorder;
+  QHash<QByteArray, QStringList> byhash;
+  QHash<QByteArray, QList<QByteArray>> bycontent;
+  QStringList unreadable;
+  for (auto i = tasks.constBegin(); i != tasks.constEnd(); ++i) {
+    for (int x = 0; x < (*i)->m_files.size(); ++x) {
+      QByteArray hash = (*i)->infohashes.at(x);
+      QByteArray content = (*i)->contentkeys.at(x);
+      if (hash.isEmpty()) {
+        unreadable << (*i)->m_files.at(x);
+        continue;
+      }
+      if (!byhash.contains(hash))
+        hashorder << hash;
+      byhash[hash] << (*i)->m_files.at(x);
+      if (content.isEmpty())
+        continue;
+      if (!bycontent.contains(content))
+        contentorder << content;
+      if (!bycontent.value(content).contains(hash))
+        bycontent[content] << hash;
+    }
+    delete (*i);
+  }
+
+  int hashgroups = 0, contentgroups = 0;
+  for (auto i = hashorder.constBegin(); i != hashorder.constEnd(); ++i) {
+    QStringList paths = byhash.value((*i));
+    if (paths.size() < 2)
+      continue;
+    ++hashgroups;
+    if (verbose)
+      out << "Same info hash " << (*i).toHex() << ":" << Qt::endl;
+    else
+      out << "= " << (*i).toHex() << Qt::endl;
+    for (auto x = paths.constBegin(); x != paths.constEnd(); ++x)
+      out << (verbose ? "  " : "") << (*x) << Qt::endl;
+    out << Qt::endl;
+  }
+  for (auto i = contentorder.constBegin(); i != contentorder.constEnd(); ++i) {
+    QList<QByteArray> hashes = bycontent.value((*i));
+    if (hashes.size() < 2)
+      continue;
+    ++contentgroups;
+    if (verbose)
+      out << "Same content, different info hash:" << Qt::endl;
+    else
+      out << "~ " << (*i).toHex() << Qt::endl;
+    for (auto x = hashes.constBegin(); x != hashes.constEnd(); ++x)
+      out << (verbose ? "  " : "") << (*x).toHex() << " "
+          << byhash.value((*x)).join(" ") << Qt::endl;
+    out << Qt::endl;
+  }
+  for (auto i = unreadable.constBegin(); i != unreadable.constEnd(); ++i)
+    out << (verbose ? "Can't read: " : "! ") << (*i) << Qt::endl;
+
+  if (verbose)
+    out << files.size() << " torrents, " << hashgroups
+        << " with the same info hash, " << contentgroups
+        << " with the same content." << Qt::endl;
+  return hashgroups || contentgroups ? 1 : 0;
+}
+
+// Returns the bencoded values of keys in t, suitable for
+// TorrentFileView::splice(). Keys t doesn't contain map to an empty value
+// (removed).
+QMap<QByteArray, QByteArray> changedKeys(TorrentFile &t,
+                                         const QStringList &keys) {
+  QMap<QByteArray, QByteArray> changes;
+  QVariantMap m = t.toVariant().toMap();
+  for (auto i = keys.constBegin(); i != keys.constEnd(); ++i)
+    changes.insert((*i).toUtf8(),
+                   m.contains((*i)) ? t.encode(m.value((*i))) : QByteArray());
+  return changes;
+}
+
+// Rewrites all files in parallel and prints "<old hash> <new hash> <path>"
+// per file. Returns 1 if any file couldn't be rewritten.
+int bulkRewrite(const QStringList &files,
+                const QMap<QByteArray, QByteArray> &changes,
+                const QMap<QByteArray, QByteArray> &infochanges,
+                const QList<QPair<QString, QString>> &replace, bool verbose) {
+  QThreadPool pool;
+  pool.setMaxThreadCount(qMax(2, QThread::idealThreadCount()));
+  QList<RewriteTask *> tasks;
+  for (qsizetype i = 0; i < files.size(); i += 64) {
+    RewriteTask *task = new RewriteTask(files.mid(i, 64));
+    task->m_changes = changes;
+    task->m_infochanges = infochanges;
+    task->m_replace = replace;
+    tasks << task;
+    pool.start(task);
+  }
+  pool.waitForDone();
+
+  int failed = 0, changed = 0;
+  for (auto i = tasks.constBegin(); i != tasks.constEnd(); ++i) {
+    for (int x = 0; x < (*i)->m_files.size(); ++x) {
+      if (!(*i)->errors.at(x).isEmpty()) {
+        ++failed;
+        out << "Error: " << (*i)->errors.at(x) << ": " << (*i)->m_files.at(x)
+            << Qt::endl;
+        continue;
+      }
+      if ((*i)->oldhashes.at(x) != (*i)->newhashes.at(x))
+        ++changed;
+      out << (*i)->oldhashes.at(x).toHex() << " "
+          << (*i)->newhashes.at(x).toHex() << " " << (*i)->m_files.at(x)
+          << Qt::endl;
+    }
+    delete (*i);
+  }
+  if (verbose)
+    out << files.size() << " torrents, " << changed
+        << " with a new info hash, " << failed << " failed." << Qt::endl;
+  return failed ? 1 : 0;
+}
+
 int main(int argc, char *argv[]) {
 
   QCoreApplication app(argc, argv);
@@ -39,7 +214,9 @@ int main(int argc, char *argv[]) {
   p.setApplicationDescription("[S]imple [T]orrent [C]reator");
   p.addPositionalArgument(
       "source",
-      "The path to a file or directory you want to create a torrent from.");
+      "The path to a file or directory you want to create a torrent from. "
+      "'-' reads a single file from stdin, it needs a name (-n) and uses a "
+      "piece length of 4 MiB unless -l is given.");
   p.addPositionalArgument(
       "target", "The path where to save the metainfo (.torrent) file.");
   p.addOptions({
@@ -47,6 +224,15 @@ int main(int argc, char *argv[]) {
        "Adds a announce url. Can be used multiple times.",
        "announce"},
       {{"c", "comment"}, "Sets the torrents comment to <comment>", "comment"},
+      {"checksum",
+       "Calculates a checksum of every file in the same pass as the piece "
+       "hashes. 'sha1' and 'md5' are added to the metainfo, 'sha256' needs "
+       "--checksum-file.",
+       "sha1|md5|sha256"},
+      {"checksum-file",
+       "Writes the --checksum results to <file> in the format of "
+       "sha1sum / md5sum / sha256sum.",
+       "file"},
       {{"d", "data"},
        "You can set any additional key value pair inside the info dictionary. "
        "Key and value must be "
@@ -57,6 +243,13 @@ int main(int argc, char *argv[]) {
        "Key and value must be "
        "seperated with a '=' e.g.: '-d mykey1=myvalue1 -d mykey2=myvalue2'.",
        "data"},
+      {"crossseed",
+       "Usage: \"stc --crossseed --root <datadir> [--root <datadir>]... "
+       "<directory|listfile|torrentfile>...\".\nFinds local data for "
+       "existing torrents by file length and name and confirms candidates by "
+       "hashing a few sampled pieces. Prints the torrent and the directory "
+       "to seed it from (or '-' if the data was renamed, use -v to see the "
+       "file mapping)."},
       {"dupe",
        "Usage: \"stc --dupe <original.torrent> <announce> "
        "<new.torrent>\".Creates a duplicate of the original having a "
@@ -67,18 +260,115 @@ int main(int argc, char *argv[]) {
       {"hashcompare",
        "Usage: \"stc --hashcompare <torrentfile1> <torrentfile2> "
        "[<torrentfileX>]...\".\nIf used without -v just prints 0(not the "
-       "same) or 1(equal). The return code will also reflect this."},
+       "same) or 1(equal). The return code will also reflect this.\nWith "
+       "--bulk compares a whole corpus instead."},
+      {"bulk",
+       "Usage: \"stc --hashcompare --bulk <directory|listfile>...\".\n"
+       "Reads all *.torrent files below the directories and all files "
+       "listed in the list files ('-' for stdin) in parallel and prints "
+       "groups of duplicates: '=' same info hash, '~' same pieces and piece "
+       "length but a different info hash. The return code is 1 if any "
+       "duplicates were found."},
+      {"fastresume",
+       "Writes a libtorrent .fastresume file for the new torrent, so "
+       "libtorrent based clients (qBittorrent, Deluge) seed it without a "
+       "recheck.",
+       "file"},
+      {"end-marker",
+       "Used with --follow: finishes once <file> exists, e.g. for writers "
+       "that keep the capture open.",
+       "file"},
+      {"fields",
+       "Used with --inspect: outputs only these keys as JSON, seperated "
+       "with ',' e.g.: '--fields name,infohash,files[].path'.",
+       "keys"},
+      {"follow",
+       "Hashes a file that is still being written: full pieces are hashed "
+       "as it grows and the torrent is written as soon as the writer closes "
+       "it (or --end-marker appears). The piece length defaults to 4 MiB. "
+       "Any process closing the file after writing to it ends the follow, "
+       "so use --end-marker if several writers take turns. A file that is "
+       "already closed when hashing starts waits forever without "
+       "--end-marker."},
       {{"i", "inspect"},
        "Prints information about the torrentfile. If -v is set outputs JSON "
        "representation.",
        "torrentfile"},
+      {"kernel-sha1",
+       "Hashes with the kernel crypto API (AF_ALG) and splices the file data "
+       "straight into it, so it isn't copied to user space. Uses "
+       "accelerated kernel drivers if there are any, falls back to the "
+       "built-in SHA1 if AF_ALG is missing. --plan reports its speed but "
+       "only uses it with this option."},
+      {"max-metainfo-size",
+       "Used with --plan: doubles the piece length until the torrent file "
+       "is no larger than <size> e.g.: '1m'.",
+       "size"},
+      {"merge",
+       "Writes the torrent from the partial files of all --shard runs "
+       "(<target>.shardIofN) instead of hashing. Needs the same source and "
+       "options as the shards."},
       {{"n", "name"}, "Sets an alternate name.", "name"},
+      {"public", "Used with --rewrite: removes the private flag."},
       {{"o", "overwrite"},
        "Overwrite existing metainfo file without asking."},
       {{"p", "private"}, "Sets the torrents private flag."},
+      {"piece-count",
+       "Used with --plan: picks the piece length giving the number of pieces "
+       "closest to <count>.",
+       "count"},
+      {"plan",
+       "Calibrates read and SHA1 speed on the source first and picks the "
+       "piece length (see --piece-count, --max-metainfo-size), the number of "
+       "readers and hash workers from it. Prints the predicted duration, "
+       "works with -t."},
+      {"pad",
+       "Inserts BEP 47 padding files so every file starts at a piece "
+       "boundary. The piece hashes of a file then only depend on its own "
+       "content."},
+      {"physical-order",
+       "Reads the pieces in the order they are stored on disk (FIEMAP) "
+       "instead of file order. Speeds up hashing fragmented files on "
+       "rotational disks, no effect on file systems without FIEMAP."},
       {{"r", "randomhash"},
        "Creates the torrent with a random piece hash (useful for some file "
        "based duplicate checkers)."},
+      {"replace",
+       "Used with --rewrite: replaces <old> with <new> in all announce urls "
+       "e.g.: '--replace tracker.old.org=tracker.new.org'. Can be used "
+       "multiple times.",
+       "old=new"},
+      {"rewrite",
+       "Usage: \"stc --rewrite [-a <url>]... [-w <url>]... [-c <comment>] "
+       "[-p|--public] [--replace <old=new>]... <directory|listfile|"
+       "torrentfile>...\".\nEdits torrent files in place (in parallel, "
+       "atomically replaced). Only the given keys are changed, the rest is "
+       "copied byte for byte. An empty comment removes it. Prints the old "
+       "and new info hash of every file, the info hash only changes with "
+       "-p / --public."},
+      {"rtorrent-resume",
+       "Writes a copy of the new torrent with rTorrent resume data "
+       "(libtorrent_resume and rtorrent keys) to <file>, load that one into "
+       "rTorrent to seed without a recheck.",
+       "file"},
+      {"root", "Data directory searched by --crossseed. Can be used multiple "
+               "times.",
+       "datadir"},
+      {"resume",
+       "Continues an interrupted creation of the same target. Finished "
+       "pieces are checkpointed to <target>.stcresume while hashing, they "
+       "are reused if the files, their sizes and modification times and the "
+       "piece length are unchanged."},
+      {"sample",
+       "Used with --verify: checks only <percent> of the pieces e.g.: "
+       "'--sample 1%'.",
+       "percent"},
+      {"sample-pieces", "Used with --verify: checks only <count> pieces.",
+       "count"},
+      {"seed",
+       "Used with --verify: seeds the piece selection of --sample, the same "
+       "seed checks the same pieces. Default 0.",
+       "number"},
       {{"s", "l", "size", "length"},
        "Piece length in bytes. You can append a 'k' for KiB or 'm' for MiB "
        "e.g.: '-l512k' for 524288 bytes.",
@@ -87,23 +377,57 @@ int main(int argc, char *argv[]) {
        "Doesn't hash or create a metafile. Can be used to calculate the "
        "piece length, number of pieces and the metainfo size before "
        "creating."},
+      {"shard",
+       "Hashes only part <i> of <n> piece aligned parts (e.g. '--shard 2/4') "
+       "and writes the pieces to <target>.shard2of4. Run all parts, in "
+       "parallel or on other hosts mounting the same data, then --merge.",
+       "i/n"},
+      {"split-max-size",
+       "Splits a directory into consecutive parts of at most <size> (e.g. "
+       "'500g') and creates <target>.partN.torrent for each in a single "
+       "hashing pass. All parts keep the directory name so they seed from "
+       "the same place.",
+       "size"},
+      {"trace",
+       "Records when every piece is read and hashed, file opens / closes "
+       "and waits for free hash workers and writes them to <file> in "
+       "Chrome trace format (open in chrome://tracing or "
+       "ui.perfetto.dev).",
+       "file"},
+      {"verify",
+       "Usage: \"stc --verify <torrentfile> [--sample <percent>|"
+       "--sample-pieces <count>] <savepath>\".\nChecks the data in "
+       "<savepath> against the torrent and prints the result per file. With "
+       "a sample the pieces are spread over the whole content and every file "
+       "gets at least one piece. The return code is 1 if any piece differs "
+       "or can't be read.",
+       "torrentfile"},
       {{"v", "verbose"},
        "Prints additional information dependent on the other options used."},
       {{"w", "webseed"},
        "Webseed url. Can be used multiple times.",
        "webseedurl"},
+      {"zero-check",
+       "Compares every piece read against zeros and skips hashing it if it "
+       "is empty. Helps with preallocated disk images, holes of sparse "
+       "files are skipped without it."},
   });
   p.process(app);
   bool verbose = p.isSet("verbose");
 
   if (p.isSet("hashcompare")) {
     QStringList positionals = p.positionalArguments();
+    if (p.isSet("bulk")) {
+      if (positionals.isEmpty())
+        p.showHelp(0);
+      quit(bulkHashcompare(collectTorrentFiles(positionals), verbose));
+    }
     if (positionals.size() < 2)
       p.showHelp(0);
 
     QSet<QByteArray> hashes;
     for (auto i = positionals.constBegin(); i != positionals.constEnd(); ++i) {
-      TorrentFile tf((*i));
+      TorrentFileView tf((*i));
       hashes << tf.getInfoHash();
       if (verbose)
         out << (*i) << ": " << tf.getInfoHash(true) << Qt::endl;
@@ -122,6 +446,123 @@ int main(int argc, char *argv[]) {
       quit(!verbose);
     }
   }
+
+  if (p.isSet("rewrite")) {
+    QStringList positionals = p.positionalArguments();
+    if (positionals.isEmpty())
+      p.showHelp(0);
+
+    QStringList changedkeys;
+    if (p.isSet("announce")) {
+      t.setAnnounceUrls(p.values("announce"));
+      changedkeys << "announce" << "announce-list";
+    }
+    if (p.isSet("webseed")) {
+      t.setWebseedUrls(p.values("webseed"));
+      changedkeys << "url-list";
+    }
+    if (p.isSet("comment")) {
+      t.setComment(p.value("comment"));
+      changedkeys << "comment";
+    }
+    QMap<QByteArray, QByteArray> changes = changedKeys(t, changedkeys);
+    QMap<QByteArray, QByteArray> infochanges;
+    if (p.isSet("private"))
+      infochanges.insert("private", "i1e");
+    else if (p.isSet("public"))
+      infochanges.insert("private", QByteArray());
+    QList<QPair<QString, QString>> replace;
+    QStringList rl = p.values("replace");
+    for (auto i = rl.constBegin(); i != rl.constEnd(); ++i)
+      if ((*i).contains('='))
+        replace << QPair<QString, QString>((*i).section('=', 0, 0),
+                                           (*i).section('=', 1));
+    if (changes.isEmpty() && infochanges.isEmpty() && replace.isEmpty())
+      p.showHelp(0);
+
+    quit(bulkRewrite(collectTorrentFiles(positionals), changes, infochanges,
+                     replace, verbose));
+  }
+
+  if (p.isSet("verify")) {
+    QStringList positionals = p.positionalArguments();
+    if (positionals.size() != 1)
+      p.showHelp(0);
+
+    TorrentFile v;
+    if (!v.load(p.value("verify"), TorrentFile::STANDARD)) {
+      out << "Can't read: " << p.value("verify") << Qt::endl;
+      quit(1);
+    }
+    v.setRootDirectory(positionals.first());
+    qint64 count = 0;
+    if (p.isSet("sample-pieces"))
+      count = qMax(1LL, p.value("sample-pieces").toLongLong());
+    else if (p.isSet("sample")) {
+      double percent = QString(p.value("sample")).remove('%').toDouble();
+      count = qMax(1LL, qint64(v.getPieces().size() / 20 * percent / 100));
+    }
+
+    QList<TorrentFile::VerifyResult> results =
+        v.verify(count, p.value("seed").toUInt());
+    if (results.isEmpty()) {
+      out << "The piece data doesn't match the file list." << Qt::endl;
+      quit(1);
+    }
+    qint64 checked = 0, failedfiles = 0;
+    QString root = positionals.first();
+    if (!root.endsWith('/'))
+      root += '/';
+    for (auto i = results.constBegin(); i != results.constEnd(); ++i) {
+      QString path = (*i).path.mid(root.length());
+      checked += (*i).checked;
+      if ((*i).failed) {
+        ++failedfiles;
+        out << "FAIL\t" << path << "\t" << (*i).failed << "/" << (*i).checked
+            << " pieces differ" << Qt::endl;
+      } else if (verbose || !(*i).checked)
+        out << ((*i).checked ? "OK\t" : "EMPTY\t") << path << "\t"
+            << (*i).checked << " pieces" << Qt::endl;
+    }
+    out << results.size() - failedfiles << " of " << results.size()
+        << " files passed, " << checked << " piece checks." << Qt::endl;
+    quit(failedfiles ? 1 : 0);
+  }
+
+  if (p.isSet("crossseed")) {
+    QStringList positionals = p.positionalArguments();
+    if (positionals.isEmpty() || !p.isSet("root"))
+      p.showHelp(0);
+
+    CrossSeedMatcher m;
+    QStringList torrents = collectTorrentFiles(positionals);
+    for (auto i = torrents.constBegin(); i != torrents.constEnd(); ++i)
+      if (!m.addTorrent((*i)) && verbose)
+        out << "Can't read: " << (*i) << Qt::endl;
+    QStringList roots = p.values("root");
+    for (auto i = roots.constBegin(); i != roots.constEnd(); ++i)
+      m.scan((*i));
+
+    QList<CrossSeedMatcher::Match> candidates = m.candidates();
+    int matches = 0;
+    for (auto i = candidates.constBegin(); i != candidates.constEnd(); ++i) {
+      bool ok = m.verify((*i));
+      if (verbose) {
+        out << (*i).torrent << ": " << (ok ? "match" : "sampled pieces differ")
+            << Qt::endl;
+        for (auto x = (*i).files.constBegin(); x != (*i).files.constEnd(); ++x)
+          out << "  " << (*x).first << Qt::endl;
+      } else if (ok)
+        out << (*i).torrent << "\t"
+            << ((*i).savepath.isEmpty() ? "-" : (*i).savepath) << Qt::endl;
+      if (ok)
+        ++matches;
+    }
+    if (verbose)
+      out << m.torrentCount() << " torrents, " << candidates.size()
+          << " candidates, " << matches << " verified." << Qt::endl;
+    quit();
+  }
   out << Qt::endl;
 
   if (p.isSet("dupe")) {
@@ -133,33 +574,38 @@ int main(int argc, char *argv[]) {
     QString announce = positionals.at(1);
     QString target = positionals.at(2);
 
-    if (!t.load(source, TorrentFile::ADDITIONAL)) {
+    // the original is never fully decoded / re-encoded, only the changed keys
+    // are spliced into the original bytes
+    TorrentFileView v(source);
+    if (!v.isValid()) {
       out << "Can't find " << source << Qt::endl;
       quit(1);
     }
-    QByteArray ohash = t.getInfoHash();
-    if (verbose) {
-      QVariantMap m = t.toVariant().toMap();
-      QVariantMap info = m.value("info").toMap();
-      info.insert("pieces", "<stripped>");
-      m.insert("info", info);
-      out << QJsonDocument::fromVariant(m).toJson() << Qt::endl;
-    }
+    QByteArray ohash = v.getInfoHash();
+    if (verbose)
+      v.writeJson(out);
     out << "Original hash: " << ohash.toHex() << Qt::endl;
 
     t.setAnnounceUrls(QStringList() << announce << p.values("announce"));
     if (p.isSet("webseed"))
-      t.setWebseedUrls(p.values("webseed") << t.getWebseedUrls());
+      t.setWebseedUrls(p.values("webseed") << v.getWebseedUrls());
+    QStringList changedkeys = QStringList() << "announce" << "announce-list"
+                                            << "creation date" << "created by";
+    if (p.isSet("webseed"))
+      changedkeys << "url-list";
+    QMap<QByteArray, QByteArray> changes = changedKeys(t, changedkeys);
+    QMap<QByteArray, QByteArray> infochanges;
     if (p.isSet("private"))
-      t.setPrivate(!t.isPrivate());
-    t.setCreationDate(QDateTime::currentMSecsSinceEpoch() / 1000);
-    t.setCreatedBy(QString("%1 %2").arg(APPNAME, VERSION));
-    QByteArray bcode;
-    while (ohash == t.getInfoHash()) {
-      t.dupe();
-      bcode = t.encode(t.toVariant().toMap(), true);
-    }
-    out << "Duplicate hash: " << t.getInfoHash(true) << Qt::endl;
+      infochanges.insert("private", v.isPrivate() ? QByteArray() : "i1e");
+    qint64 duped = QDateTime::currentMSecsSinceEpoch() / 1000;
+    if (v.infoValue("stcduped", 0).toLongLong() == duped)
+      ++duped;
+    infochanges.insert("stcduped", "i" + QByteArray::number(duped) + "e");
+
+    QByteArray dhash;
+    QByteArray bcode = v.splice(changes, infochanges, &dhash);
+    v.close();
+    out << "Duplicate hash: " << dhash.toHex() << Qt::endl;
 
     if (QFile::exists(target) && !p.isSet("overwrite")) {
       QTextStream in(stdin);
@@ -181,37 +627,37 @@ int main(int argc, char *argv[]) {
   }
 
   if (p.isSet("inspect")) {
-    t.load(p.value("inspect"));
-
-    if (verbose) {
-      QVariantMap m = t.toVariant().toMap();
-      QVariantMap info = m.value("info").toMap();
-      info.insert("pieces", "<stripped>");
-      m.insert("info", info);
-      out << QJsonDocument::fromVariant(m).toJson() << Qt::endl;
+    // only decodes what is printed, the file list is just iterated
+    TorrentFileView v(p.value("inspect"));
+    if (!v.isValid()) {
+      out << "Can't read " << p.value("inspect") << Qt::endl;
+      quit(1);
+    }
+    if (verbose || p.isSet("fields")) {
+      v.writeJson(out, p.values("fields").join(",").split(
+                           ",", Qt::SkipEmptyParts));
     } else {
-      out << "Name: " << t.getName() << Qt::endl;
-      out << "Announce urls: " << t.getAnnounceUrls().join(", ") << Qt::endl;
-      if (!t.getWebseedUrls().isEmpty())
-        out << "Webseed urls: " << t.getWebseedUrls().join(", ") << Qt::endl;
-      if (!t.getCreatedBy().isEmpty())
-        out << "Created by: " << t.getCreatedBy() << Qt::endl;
-      if (t.getCreationDate())
+      out << "Name: " << v.getName() << Qt::endl;
+      out << "Announce urls: " << v.getAnnounceUrls().join(", ") << Qt::endl;
+      if (!v.getWebseedUrls().isEmpty())
+        out << "Webseed urls: " << v.getWebseedUrls().join(", ") << Qt::endl;
+      if (!v.getCreatedBy().isEmpty())
+        out << "Created by: " << v.getCreatedBy() << Qt::endl;
+      if (v.getCreationDate())
         out << "Creation date: "
-            << QDateTime::fromSecsSinceEpoch(t.getCreationDate(),
+            << QDateTime::fromSecsSinceEpoch(v.getCreationDate(),
                                              QTimeZone::UTC)
                    .toString(Qt::ISODate)
             << Qt::endl;
-      if (!t.getComment().isEmpty())
-        out << "Comment: " << t.getComment() << Qt::endl;
-      if (t.isPrivate())
+      if (!v.getComment().isEmpty())
+        out << "Comment: " << v.getComment() << Qt::endl;
+      if (v.isPrivate())
         out << "Private: true" << Qt::endl;
-      out << "Total size: " << prettySize(t.getContentLength()) << Qt::endl;
-      out << "Piece length: " << prettySize(t.getPieceLength()) << Qt::endl;
-      out << "Number of pieces: " << t.getPieceNumber() << Qt::endl;
-      out << "Metainfo size: " << prettySize(t.calculateTorrentfileSize())
-          << Qt::endl;
-      out << "Info hash: " << t.getInfoHash(true) << Qt::endl;
+      out << "Total size: " << prettySize(v.getContentLength()) << Qt::endl;
+      out << "Piece length: " << prettySize(v.getPieceLength()) << Qt::endl;
+      out << "Number of pieces: " << v.getPieceNumber() << Qt::endl;
+      out << "Metainfo size: " << prettySize(v.size()) << Qt::endl;
+      out << "Info hash: " << v.getInfoHash(true) << Qt::endl;
     }
     quit();
   }
@@ -222,11 +668,46 @@ int main(int argc, char *argv[]) {
   QString source = positionals.at(0);
   QString target = positionals.at(1);
 
-  if (QFileInfo(source).isDir())
-    t.setDirectory(source);
+  // the length of a stream or followed file is only known at its end, so
+  // the piece length can't be derived from it
+  bool stream = source == "-";
+  bool follow = p.isSet("follow");
+  const qint64 streampiecelength = 4 * 1024 * 1024;
+  if (stream) {
+    if (!p.isSet("name")) {
+      out << "Reading from stdin requires a name (-n)." << Qt::endl;
+      quit(1);
+    }
+    t.setStream(p.value("name"));
+  } else if (follow) {
+    if (!QFileInfo(source).isFile()) {
+      out << "--follow needs a single file." << Qt::endl;
+      quit(1);
+    }
+    t.setFollow(source, p.value("end-marker"));
+  } else if (QFileInfo(source).isDir())
+    t.setDirectory(source, p.isSet("pad"));
   else
     t.setFile(source);
 
+  bool split = p.isSet("split-max-size");
+  if (split) {
+    if (stream || follow || p.isSet("pad") || p.isSet("randomhash") ||
+        p.isSet("fastresume") || p.isSet("rtorrent-resume") ||
+        !QFileInfo(source).isDir()) {
+      out << "--split-max-size needs a directory and can't be combined with "
+             "--pad, --follow, -r or resume data."
+          << Qt::endl;
+      quit(1);
+    }
+    qint64 maxsize = parseSize(p.value("split-max-size"));
+    if (maxsize <= 0) {
+      out << "Invalid size: " << p.value("split-max-size") << Qt::endl;
+      quit(1);
+    }
+    t.setSplit(maxsize);
+  }
+
   t.setAnnounceUrls(QStringList() << p.values("announce"));
   t.setComment(p.value("comment"));
   QStringList infodata = p.values("data");
@@ -241,34 +722,172 @@ int main(int argc, char *argv[]) {
     t.setPrivate(true);
   QString plength = p.value("length");
   if (!plength.isEmpty()) {
-    qint64 length = plength.toLongLong();
-    if (plength.endsWith('k', Qt::CaseInsensitive))
-      length = plength.left(plength.length() - 1).toLongLong() * 1024;
-    if (plength.endsWith('m', Qt::CaseInsensitive))
-      length = plength.left(plength.length() - 1).toLongLong() * 1024 * 1024;
-    if (!length)
+    qint64 length = parseSize(plength);
+    if (!length && (stream || follow))
+      t.setPieceLength(streampiecelength);
+    else if (!length)
       t.setAutomaticPieceLength();
     else
       t.setPieceLength(length);
-  } else
+  } else if (stream || follow)
+    t.setPieceLength(streampiecelength);
+  else
     t.setAutomaticPieceLength();
   t.setWebseedUrls(p.values("webseed"));
+  if (p.isSet("checksum")) {
+    if (p.value("checksum") == "sha256" && !p.isSet("checksum-file")) {
+      out << "sha256 checksums need a --checksum-file." << Qt::endl;
+      quit(1);
+    }
+    if (!t.setFileChecksum(p.value("checksum"), p.value("checksum-file"))) {
+      out << "Unknown checksum type: " << p.value("checksum") << Qt::endl;
+      quit(1);
+    }
+  }
 
-  if (verbose)
-    out << QJsonDocument::fromVariant(t.toVariant()).toJson() << Qt::endl;
+  // --plan predicts with the SHA1 that will be used
+  if (p.isSet("kernel-sha1")) {
+    if (!KernelSha1::available())
+      out << "Kernel SHA1 (AF_ALG) not available, using the built-in one."
+          << Qt::endl;
+    t.setKernelHash(true);
+  }
+
+  if (p.isSet("plan") && (stream || follow))
+    out << "--plan needs the data up front, ignored." << Qt::endl;
+  else if (p.isSet("plan")) {
+    out << "Calibrating..." << Qt::endl;
+    TorrentFile::Plan plan =
+        t.plan(parseSize(p.value("max-metainfo-size")),
+               p.value("piece-count").toLongLong(), !p.isSet("length"));
+    out << "Read speed: " << prettySize(plan.readrate) << "/s with "
+        << plan.readers << (plan.readers > 1 ? " readers" : " reader")
+        << Qt::endl;
+    out << "Kernel SHA1 (AF_ALG): "
+        << (plan.kernelrate > 0 ? prettySize(plan.kernelrate) + "/s per core"
+                                : QString("not available"))
+        << Qt::endl;
+    out << "SHA1 speed: " << prettySize(plan.hashrate) << "/s per core ("
+        << (plan.kernelsha1 ? "kernel" : "built-in") << "), "
+        << plan.workers << (plan.workers > 1 ? " workers" : " worker")
+        << Qt::endl;
+    // hours aren't wrapped at a day, multi-TB jobs can take longer
+    qint64 seconds = plan.duration / 1000;
+    out << "Predicted duration: "
+        << QString("%1:%2:%3")
+               .arg(seconds / 3600, 2, 10, QChar('0'))
+               .arg(seconds % 3600 / 60, 2, 10, QChar('0'))
+               .arg(seconds % 60, 2, 10, QChar('0'))
+        << Qt::endl;
+  }
+
+  if (verbose) {
+    TorrentFileView v;
+    v.openData(t.encode(t.toVariant()));
+    v.writeJson(out);
+  }
 
-  out << "Total size: " << prettySize(t.getContentLength()) << Qt::endl;
-  out << "Piece length: " << prettySize(t.getPieceLength()) << Qt::endl;
-  out << "Number of pieces: " << t.getPieceNumber() << Qt::endl;
-  out << "Metainfo size: " << prettySize(t.calculateTorrentfileSize())
-      << Qt::endl;
+  if (stream || follow) {
+    out << "Total size: unknown ("
+        << (stream ? "reading from stdin" : "following " + source) << ")"
+        << Qt::endl;
+    out << "Piece length: " << prettySize(t.getPieceLength()) << Qt::endl;
+  } else if (split) {
+    out << "Total size: " << prettySize(t.getContentLength()) << Qt::endl;
+    out << "Piece length: " << prettySize(t.getPieceLength()) << Qt::endl;
+    QList<QPair<int, qint64>> groups = t.splitGroups();
+    qint64 maxsize = parseSize(p.value("split-max-size"));
+    out << "Parts: " << groups.size() << Qt::endl;
+    for (int i = 0; i < groups.size(); ++i)
+      out << "  part" << i + 1 << ": " << prettySize(groups.at(i).second)
+          << ", "
+          << (groups.at(i).second + t.getPieceLength() - 1) /
+                 t.getPieceLength()
+          << " pieces"
+          << (groups.at(i).second > maxsize
+                  ? " (a single file larger than the limit)"
+                  : "")
+          << Qt::endl;
+  } else {
+    out << "Total size: " << prettySize(t.getContentLength()) << Qt::endl;
+    out << "Piece length: " << prettySize(t.getPieceLength()) << Qt::endl;
+    out << "Number of pieces: " << t.getPieceNumber() << Qt::endl;
+    out << "Metainfo size: " << prettySize(t.calculateTorrentfileSize())
+        << Qt::endl;
+  }
 
   if (p.isSet("simulate"))
     quit();
 
-  if (QFile::exists(target) && !p.isSet("overwrite")) {
+  if ((stream || follow) &&
+      (p.isSet("fastresume") || p.isSet("rtorrent-resume"))) {
+    out << "Resume data can't be created for a stream or followed file."
+        << Qt::endl;
+    quit(1);
+  }
+
+  if (stream && (p.isSet("randomhash") ||
+                 (QFile::exists(target) && !p.isSet("overwrite")))) {
+    // stdin carries the data, there is nothing to ask the user with
+    out << (p.isSet("randomhash")
+                ? "A random hash can't be used when reading from stdin."
+                : target + " already exists, use -o to overwrite it.")
+        << Qt::endl;
+    quit(1);
+  }
+
+  // a shard writes its partial pieces next to the target, --merge
+  // collects them
+  bool sharded = p.isSet("shard"), merge = p.isSet("merge");
+  QStringList shardfiles;
+  if (sharded || merge) {
+    // the shards hash at different times, a merge can't tell if the files
+    // changed in between, which resume data would have to vouch for
+    if (stream || follow || split || p.isSet("checksum") ||
+        p.isSet("randomhash") || p.isSet("resume") ||
+        p.isSet("fastresume") || p.isSet("rtorrent-resume") ||
+        (sharded && merge)) {
+      out << "--shard / --merge can't be combined with stdin, --follow, "
+             "--split-max-size, --checksum, -r, --resume or resume data."
+          << Qt::endl;
+      quit(1);
+    }
+    QFileInfo ti(target);
+    if (sharded) {
+      int index = p.value("shard").section('/', 0, 0).toInt();
+      int count = p.value("shard").section('/', 1).toInt();
+      if (index < 1 || index > count) {
+        out << "Invalid shard: " << p.value("shard") << Qt::endl;
+        quit(1);
+      }
+      t.setShard(index - 1, count);
+      target += QString(".shard%1of%2").arg(index).arg(count);
+    } else {
+      QStringList names = QDir(ti.absolutePath())
+                              .entryList({ti.fileName() + ".shard*of*"},
+                                         QDir::Files, QDir::Name);
+      for (auto i = names.constBegin(); i != names.constEnd(); ++i)
+        shardfiles << ti.absolutePath() + "/" + (*i);
+      if (shardfiles.isEmpty()) {
+        out << "No shards found for " << target << Qt::endl;
+        quit(1);
+      }
+    }
+  }
+
+  // a split run doesn't write target itself but one torrent per part
+  QStringList existing;
+  if (split) {
+    for (int i = 0; i < t.splitGroups().size(); ++i)
+      if (QFile::exists(TorrentFile::splitFileName(target, i)))
+        existing << TorrentFile::splitFileName(target, i);
+  } else if (QFile::exists(target))
+    existing << target;
+  if (!existing.isEmpty() && !p.isSet("overwrite") && !p.isSet("resume")) {
     QTextStream in(stdin);
-    out << target << " already exists, overwrite? [Y]es / [N]o" << Qt::endl;
+    out << existing.join(", ")
+        << (existing.size() > 1 ? " already exist" : " already exists")
+        << ", overwrite? [Y]es / [N]o" << Qt::endl;
     QString c;
     in >> c;
     if (QString::compare(c, "y", Qt::CaseInsensitive))
@@ -316,11 +935,22 @@ int main(int argc, char *argv[]) {
                .arg(s, 2, 10, QChar('0'))
         << Qt::flush;
   });
+  QObject::connect(&t, &TorrentFile::checkpointDiscarded, [&]() {
+    out << Qt::endl
+        << "Checkpoint doesn't match, starting over." << Qt::endl;
+  });
   QObject::connect(&t, &TorrentFile::finished, [&](bool s) {
     out << Qt::endl;
     if (!s)
       out << Qt::endl << "Something went wrong, operation failed!" << Qt::endl;
-    else
+    else if (sharded)
+      out << Qt::endl << "Finished: Shard written to " << target << Qt::endl;
+    else if (split) {
+      QList<QPair<QString, QByteArray>> parts = t.splitResults();
+      out << Qt::endl << "Finished:" << Qt::endl;
+      for (auto i = parts.constBegin(); i != parts.constEnd(); ++i)
+        out << (*i).first << ": Info hash: " << (*i).second << Qt::endl;
+    } else
       out << Qt::endl
           << "Finished: Info hash: " << t.getInfoHash(true) << Qt::endl;
     app.quit();
@@ -330,7 +960,14 @@ int main(int argc, char *argv[]) {
     app.quit();
   });
 
-  if (!t.create(target)) {
+  t.setPhysicalOrder(p.isSet("physical-order"));
+  t.setZeroCheck(p.isSet("zero-check"));
+  t.setResumeData(p.value("fastresume"), p.value("rtorrent-resume"));
+  t.setTrace(p.value("trace"));
+  if (merge) {
+    if (!t.merge(target, shardfiles))
+      quit(1);
+  } else if (!t.create(target, p.isSet("resume"))) {
     out << Qt::endl << "Files not found." << Qt::endl;
     quit();
   } else
@@ -1,5 +1,22 @@
 #include "torrentfile.h"
 
+#include <QSaveFile>
+#include <QRandomGenerator>
+
+#include <cmath>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <sys/xattr.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <linux/if_alg.h>
+#include <poll.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+
 QHash<QString, TorrentFile::DATATYPE> TorrentFile::standardkeys{
     {"pieces", TorrentFile::MINIMAL},
     {"info", TorrentFile::MINIMAL},
@@ -14,9 +31,662 @@ QHash<QString, TorrentFile::DATATYPE> TorrentFile::standardkeys{
     {"comment", TorrentFile::STANDARD},
     {"created by", TorrentFile::STANDARD},
     {"private", TorrentFile::STANDARD},
-    {"encoding", TorrentFile::STANDARD}
+    {"encoding", TorrentFile::STANDARD},
+    {"attr", TorrentFile::STANDARD},
+    {"sha1", TorrentFile::STANDARD},
+    {"md5sum", TorrentFile::STANDARD}
 };
 
+static QByteArray jsonString(const QString& s)
+{
+    QByteArray ret = "\"";
+    QByteArray utf8 = s.toUtf8();
+    for (auto i = utf8.constBegin(); i != utf8.constEnd(); ++i)
+    {
+        if ((*i) == '"' || (*i) == '\\')
+            ret += '\\' + QByteArray(1, *i);
+        else if (uchar(*i) < 0x20)
+            ret += "\\u00" + QByteArray::number(uchar(*i), 16).rightJustified(2, '0');
+        else
+            ret += *i;
+    }
+    return ret + "\"";
+}
+
+bool HashTrace::write(const QString &filename) const
+{
+    QMutexLocker lock(&m_mutex);
+    QByteArray json = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    for (auto i = m_threads.constBegin(); i != m_threads.constEnd(); ++i)
+        json += "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" + QByteArray::number(i.key()) + ",\"args\":{\"name\":\"" + i.value() + "\"}},\n";
+    for (auto i = m_events.constBegin(); i != m_events.constEnd(); ++i)
+    {
+        json += "{\"name\":\"" + QByteArray((*i).name) + "\",\"cat\":\"" + (*i).category + "\",\"ph\":\"X\",\"pid\":1,\"tid\":" + QByteArray::number((*i).tid)
+                + ",\"ts\":" + QByteArray::number((*i).begin) + ",\"dur\":" + QByteArray::number((*i).duration) + ",\"args\":{";
+        if ((*i).piece >= 0)
+            json += "\"piece\":" + QByteArray::number((*i).piece) + ((*i).detail.isEmpty() ? "" : ",");
+        if (!(*i).detail.isEmpty())
+            json += "\"file\":" + jsonString((*i).detail);
+        json += "}},\n";
+    }
+    // the trailing comma is allowed by the format but not by strict JSON parsers
+    if (json.endsWith(",\n"))
+        json.chop(2);
+    json += "\n]}\n";
+
+    QSaveFile f(filename);
+    return f.open(QIODevice::WriteOnly) && f.write(json) != -1 && f.commit();
+}
+
+KernelSha1::KernelSha1()
+{
+    sockaddr_alg sa = {};
+    sa.salg_family = AF_ALG;
+    strcpy(reinterpret_cast<char*>(sa.salg_type), "hash");
+    strcpy(reinterpret_cast<char*>(sa.salg_name), "sha1");
+    m_tfm = socket(AF_ALG, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (m_tfm >= 0 && !bind(m_tfm, reinterpret_cast<sockaddr*>(&sa), sizeof(sa)))
+        m_op = accept4(m_tfm, 0, 0, SOCK_CLOEXEC);
+    if (m_op >= 0 && !pipe2(m_pipe, O_CLOEXEC))
+        fcntl(m_pipe[1], F_SETPIPE_SZ, 1024 *1024);
+}
+
+KernelSha1::~KernelSha1()
+{
+    for (int fd : {m_op, m_tfm, m_pipe[0], m_pipe[1]})
+        if (fd >= 0)
+            ::close(fd);
+}
+
+bool KernelSha1::available()
+{
+    static const bool ok = KernelSha1().hash(QByteArray("abc")) == QCryptographicHash::hash("abc", QCryptographicHash::Sha1);
+    return ok;
+}
+
+QByteArray KernelSha1::hash(const QByteArray &data)
+{
+    if (m_op < 0)
+        return QByteArray();
+    qint64 pos = 0;
+    do
+    {
+        qint64 n = qMin(data.size() - pos, qint64(1024 *1024));
+        ssize_t w = send(m_op, data.constData() + pos, n, pos + n < data.size() ? MSG_MORE : 0);
+        if (w < 0)
+            return reset();
+        pos += w;
+    } while (pos < data.size());
+    return digest();
+}
+
+QByteArray KernelSha1::hash(const QList<Range> &ranges)
+{
+    QList<Range> r;
+    for (auto i = ranges.constBegin(); i != ranges.constEnd(); ++i)
+        if ((*i).length > 0)
+            r << (*i);
+    if (r.isEmpty())
+        return hash(QByteArray());
+    if (m_op < 0 || m_pipe[0] < 0)
+        return QByteArray();
+
+    for (int k = 0; k < r.size(); ++k)
+    {
+        bool last = k == r.size() -1;
+        const Range& range = r.at(k);
+        if (range.path.isEmpty())
+        {
+            static const QByteArray zeros(64 *1024, '\0');
+            for (qint64 left = range.length; left > 0;)
+            {
+                qint64 n = qMin(left, qint64(zeros.size()));
+                left -= n;
+                if (send(m_op, zeros.constData(), n, left || !last ? MSG_MORE : 0) != n)
+                    return reset();
+            }
+            continue;
+        }
+
+        int fd = ::open(QFile::encodeName(range.path).constData(), O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) || (range.size >= 0 && st.st_size != range.size))
+        {
+            if (fd >= 0)
+                ::close(fd);
+            return reset();
+        }
+        loff_t off = range.offset;
+        for (qint64 left = range.length; left > 0;)
+        {
+            ssize_t n = splice(fd, &off, m_pipe[1], 0, qMin(left, qint64(1024 *1024)), SPLICE_F_MOVE);
+            if (n <= 0)
+            {
+                ::close(fd);
+                return reset();
+            }
+            left -= n;
+            unsigned int flags = left || !last ? SPLICE_F_MORE : 0;
+            while (n > 0)
+            {
+                ssize_t m = splice(m_pipe[0], 0, m_op, 0, n, flags | SPLICE_F_MOVE);
+                if (m <= 0)
+                {
+                    ::close(fd);
+                    return reset();
+                }
+                n -= m;
+            }
+        }
+        ::close(fd);
+    }
+    return digest();
+}
+
+QByteArray KernelSha1::read(const QList<Range> &ranges)
+{
+    QByteArray ba;
+    for (auto i = ranges.constBegin(); i != ranges.constEnd(); ++i)
+    {
+        if ((*i).path.isEmpty())
+        {
+            ba += QByteArray((*i).length, '\0');
+            continue;
+        }
+        QFile f((*i).path);
+        if (!f.open(QIODevice::ReadOnly | QIODevice::Unbuffered) || ((*i).size >= 0 && f.size() != (*i).size) || !f.seek((*i).offset))
+            return QByteArray();
+        QByteArray data = f.read((*i).length);
+        if (data.length() != (*i).length)
+            return QByteArray();
+        ba += data;
+    }
+    return ba;
+}
+
+double KernelSha1::measureHashRate()
+{
+    if (!available())
+        return 0;
+    QByteArray data(4 *1024 *1024, 'x');
+    QElapsedTimer timer;
+    timer.start();
+    qint64 hashed = 0;
+    while (!hashed || timer.elapsed() < 200)
+    {
+        if (local().hash(data).isEmpty())
+            return 0;
+        hashed += data.size();
+    }
+    return hashed * 1e9 / qMax(qint64(1), timer.nsecsElapsed());
+}
+
+QByteArray KernelSha1::digest()
+{
+    QByteArray ret(20, '\0');
+    return ::read(m_op, ret.data(), ret.size()) == ret.size() ? ret : reset();
+}
+
+QByteArray KernelSha1::reset()
+{
+    for (int fd : {m_op, m_pipe[0], m_pipe[1]})
+        if (fd >= 0)
+            ::close(fd);
+    m_op = m_pipe[0] = m_pipe[1] = -1;
+    if (m_tfm >= 0)
+        m_op = accept4(m_tfm, 0, 0, SOCK_CLOEXEC);
+    if (m_op >= 0 && !pipe2(m_pipe, O_CLOEXEC))
+        fcntl(m_pipe[1], F_SETPIPE_SZ, 1024 *1024);
+    return QByteArray();
+}
+
+TorrentFileHasher::~TorrentFileHasher()
+{
+    m_pool.waitForDone();
+    m_digestpool.waitForDone();
+    clearDigests();
+    delete m_trace;
+    if (m_inotify >= 0)
+        ::close(m_inotify);
+}
+
+double TorrentFileHasher::measureReadRate(int readers, qint64 budget, int skew)
+{
+    const qint64 block = 4 *1024 *1024;
+    int blocks = qMax(qint64(1), budget / block);
+    qint64 stride = m_contentlength / (blocks * 2);
+    std::atomic<qint64> total{0};
+    QThreadPool pool;
+    pool.setMaxThreadCount(qMax(1, readers));
+    QElapsedTimer timer;
+    timer.start();
+    for (int r = 0; r < readers; ++r)
+    {
+        pool.start([&, r]()
+        {
+            QByteArray buffer(block, '\0');
+            for (int k = r; k < blocks; k += readers)
+            {
+                // map the content position to a file, padding files have nothing to read
+                qint64 pos = stride * (2 * k + (skew & 1)), offset = 0;
+                for (auto i = m_filehash.constBegin(); i != m_filehash.constEnd(); ++i)
+                {
+                    if (pos >= offset + (*i).second)
+                    {
+                        offset += (*i).second;
+                        continue;
+                    }
+                    int fd = (*i).first.isEmpty() ? -1 : ::open(QFile::encodeName((*i).first).constData(), O_RDONLY | O_CLOEXEC);
+                    if (fd >= 0)
+                    {
+                        qint64 length = qMin(block, offset + (*i).second - pos);
+                        posix_fadvise(fd, pos - offset, length, POSIX_FADV_DONTNEED);
+                        ssize_t n = pread(fd, buffer.data(), length, pos - offset);
+                        if (n > 0)
+                            total += n;
+                        ::close(fd);
+                    }
+                    break;
+                }
+            }
+        });
+    }
+    pool.waitForDone();
+    return total ? total * 1e9 / qMax(qint64(1), timer.nsecsElapsed()) : 0;
+}
+
+void TorrentFileHasher::prefetch(int index)
+{
+    m_nextprefetch = qMax(m_nextprefetch, index +1);
+    while (m_prefetch.size() < 32 && m_nextprefetch < m_filehash.size())
+    {
+        int idx = m_nextprefetch++;
+        const QPair<QString, qint64>& file = m_filehash.at(idx);
+        if (file.first.isEmpty() || file.first == "-" || !file.second || file.second > 8 *1024 *1024)
+            continue;
+        int fd = ::open(QFile::encodeName(file.first).constData(), O_RDONLY | O_CLOEXEC);
+        if (fd >= 0)
+            posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+        m_prefetch << QPair<int, int>(idx, fd);
+    }
+}
+
+int TorrentFileHasher::takePrefetched(int index)
+{
+    while (!m_prefetch.isEmpty() && m_prefetch.first().first < index)
+    {
+        if (m_prefetch.first().second >= 0)
+            ::close(m_prefetch.first().second);
+        m_prefetch.removeFirst();
+    }
+    if (m_prefetch.isEmpty() || m_prefetch.first().first != index)
+        return -1;
+    return m_prefetch.takeFirst().second;
+}
+
+void TorrentFileHasher::clearPrefetch()
+{
+    for (auto i = m_prefetch.constBegin(); i != m_prefetch.constEnd(); ++i)
+        if ((*i).second >= 0)
+            ::close((*i).second);
+    m_prefetch.clear();
+}
+
+void TorrentFileHasher::writeCheckpoint(const QByteArray &fp)
+{
+    if (!m_checkpointfile.isOpen())
+    {
+        m_checkpointfile.setFileName(m_checkpoint);
+        if (!m_checkpointfile.open(QIODevice::WriteOnly | QIODevice::Truncate) || m_checkpointfile.write(checkpointMagic() + fp) == -1)
+            return;
+    }
+    QByteArray ba;
+    while (m_checkpointed < m_hashtasks.size() && m_hashtasks.at(m_checkpointed) && m_hashtasks.at(m_checkpointed)->finished.load(std::memory_order_acquire)
+           && m_hashtasks.at(m_checkpointed)->result.size() == 20)
+        ba += m_hashtasks.at(m_checkpointed++)->result;
+    if (!ba.isEmpty() && m_checkpointfile.write(ba) != -1 && m_checkpointfile.flush())
+        fdatasync(m_checkpointfile.handle());
+}
+
+void TorrentFileHasher::findHole(int fd, qint64 pos, qint64 size, qint64 &begin, qint64 &end)
+{
+    begin = end = size;
+    qint64 hole = lseek(fd, pos, SEEK_HOLE);
+    if (hole >= 0 && hole < size)
+    {
+        qint64 data = lseek(fd, hole, SEEK_DATA);
+        begin = hole;
+        end = data < 0 ? size : data; // ENXIO: hole reaches the end of the file
+    }
+    // the probes move the offset the next read starts from
+    lseek(fd, pos, SEEK_SET);
+}
+
+QByteArray TorrentFileHasher::PieceReader::read(qint64 index, bool *hole)
+{
+    QList<KernelSha1::Range> ranges = m_hasher->pieceRanges(index);
+    qint64 length = 0;
+    for (auto i = ranges.constBegin(); i != ranges.constEnd(); ++i)
+        length += (*i).length;
+    if (hole)
+        *hole = false;
+    if (hole && ranges.size() == 1 && !ranges.first().path.isEmpty() && length == m_hasher->m_piecesize)
+    {
+        const KernelSha1::Range& r = ranges.first();
+        OpenFile* f = file(r);
+        if (!f)
+            return QByteArray();
+        // the hole found last time is reused while the pieces move forward through it
+        if (r.offset < f->probed || (r.offset >= f->holeend && f->holeend < r.size))
+        {
+            findHole(f->fd, r.offset, r.size, f->holebegin, f->holeend);
+            f->probed = r.offset;
+        }
+        *hole = r.offset >= f->holebegin && r.offset + r.length <= f->holeend;
+        if (*hole)
+            return QByteArray();
+    }
+    QByteArray ba(length, Qt::Uninitialized);
+    char* data = ba.data();
+    for (auto i = ranges.constBegin(); i != ranges.constEnd(); ++i)
+    {
+        if ((*i).path.isEmpty())
+            memset(data, 0, (*i).length);
+        else
+        {
+            OpenFile* f = file(*i);
+            for (qint64 done = 0; done < (*i).length;)
+            {
+                ssize_t n = f ? pread(f->fd, data + done, (*i).length - done, (*i).offset + done) : -1;
+                if (n <= 0)
+                    return QByteArray();
+                done += n;
+            }
+        }
+        data += (*i).length;
+    }
+    return ba;
+}
+
+void TorrentFileHasher::PieceReader::willNeed(qint64 index)
+{
+    QList<KernelSha1::Range> ranges = m_hasher->pieceRanges(index);
+    for (auto i = ranges.constBegin(); i != ranges.constEnd(); ++i)
+        if (OpenFile* f = (*i).path.isEmpty() ? 0 : file(*i))
+            posix_fadvise(f->fd, (*i).offset, (*i).length, POSIX_FADV_WILLNEED);
+}
+
+TorrentFileHasher::PieceReader::OpenFile *TorrentFileHasher::PieceReader::file(const KernelSha1::Range &r)
+{
+    auto i = m_files.find(r.path);
+    if (i != m_files.end())
+        return &i.value();
+    if (m_files.size() >= 64)
+        closeAll();
+    int fd = ::open(QFile::encodeName(r.path).constData(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) || st.st_size != r.size)
+    {
+        if (fd >= 0)
+            ::close(fd);
+        return 0;
+    }
+    return &m_files.insert(r.path, OpenFile{fd, 0, 0, 0}).value();
+}
+
+void TorrentFileHasher::PieceReader::closeAll()
+{
+    for (auto i = m_files.constBegin(); i != m_files.constEnd(); ++i)
+        ::close((*i).fd);
+    m_files.clear();
+}
+
+QList<TorrentFileHasher::Extent> TorrentFileHasher::fileExtents(int fd)
+{
+    QList<Extent> ret;
+    const int count = 256;
+    std::vector<quint64> buffer((sizeof(fiemap) + count * sizeof(fiemap_extent)) / sizeof(quint64) +1);
+    fiemap* fm = reinterpret_cast<fiemap*>(buffer.data());
+    quint64 start = 0;
+    while (true)
+    {
+        std::fill(buffer.begin(), buffer.end(), 0);
+        fm->fm_start = start;
+        fm->fm_length = FIEMAP_MAX_OFFSET - start;
+        fm->fm_extent_count = count;
+        if (ioctl(fd, FS_IOC_FIEMAP, fm) < 0 || !fm->fm_mapped_extents)
+            return ret;
+        for (quint32 i = 0; i < fm->fm_mapped_extents; ++i)
+        {
+            const fiemap_extent& e = fm->fm_extents[i];
+            if (!(e.fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC)))
+                ret << Extent{qint64(e.fe_logical), qint64(e.fe_physical), qint64(e.fe_length)};
+            start = e.fe_logical + e.fe_length;
+            if (e.fe_flags & FIEMAP_EXTENT_LAST)
+                return ret;
+        }
+    }
+}
+
+QByteArray TorrentFileHasher::backingPath(const QByteArray &path, quint64 device, QHash<quint64, bool> &fuse)
+{
+    auto f = fuse.find(device);
+    if (f == fuse.end())
+    {
+        struct statfs sfs;
+        f = fuse.insert(device, !statfs(path.constData(), &sfs) && sfs.f_type == 0x65735546); // FUSE_SUPER_MAGIC
+    }
+    if (!f.value())
+        return path;
+    char real[4096];
+    ssize_t length = getxattr(path.constData(), "user.mergerfs.fullpath", real, sizeof(real));
+    return length > 0 && length < qint64(sizeof(real)) ? QByteArray(real, length) : path;
+}
+
+std::vector<TorrentFileHasher::ReadPosition> TorrentFileHasher::planReads(qint64 firstpiece, bool physical, int *devices)
+{
+    qint64 n = (m_contentlength + m_piecesize -1) / m_piecesize;
+    if (m_rangeend >= 0)
+        n = qMin(n, m_rangeend);
+    std::vector<ReadPosition> plan;
+    plan.reserve(qMax(qint64(0), n - firstpiece));
+    QHash<quint64, bool> fuse;
+    QSet<quint64> seen;
+    qint64 offset = 0, next = firstpiece;
+    for (auto i = m_filehash.constBegin(); i != m_filehash.constEnd(); ++i)
+    {
+        qint64 fbegin = offset;
+        offset += (*i).second;
+        if (next >= n)
+            break;
+        if (next * m_piecesize >= offset)
+            continue;
+        QList<Extent> extents;
+        quint64 device = 0;
+        struct stat st;
+        QByteArray path = QFile::encodeName((*i).first);
+        if (!path.isEmpty() && !stat(path.constData(), &st))
+        {
+            device = st.st_dev;
+            QByteArray real = backingPath(path, device, fuse);
+            if (real != path)
+            {
+                path = real;
+                device = stat(path.constData(), &st) ? device : st.st_dev;
+            }
+        }
+        if (device)
+            seen.insert(device);
+        if (int fd = physical && device ? ::open(path.constData(), O_RDONLY | O_CLOEXEC) : -1; fd >= 0)
+        {
+            extents = fileExtents(fd);
+            ::close(fd);
+        }
+        auto e = extents.constBegin();
+        for (; next * m_piecesize < offset && next < n; ++next)
+        {
+            qint64 pos = next * m_piecesize - fbegin;
+            while (e != extents.constEnd() && (*e).logical + (*e).length <= pos)
+                ++e;
+            qint64 address = e != extents.constEnd() && (*e).logical <= pos ? (*e).physical + pos - (*e).logical : -1;
+            plan.push_back(ReadPosition{device, address, next});
+        }
+    }
+    if (physical)
+        std::sort(plan.begin(), plan.end());
+    if (devices)
+        *devices = seen.size();
+    return plan;
+}
+
+bool TorrentFileHasher::hashPlanned(const std::vector<ReadPosition> &plan, qint64 firstpiece, const QByteArray &fp, QElapsedTimer &checkpointtimer, qint64 &donesize, int &progress)
+{
+    QList<quint64> devices;
+    QList<QList<qint64> > queues;
+    for (auto i = plan.cbegin(); i != plan.cend(); ++i)
+    {
+        int d = devices.indexOf((*i).device);
+        if (d < 0)
+        {
+            d = devices.size();
+            devices << (*i).device;
+            queues << QList<qint64>();
+        }
+        queues[(*i).device ? d : 0] << (*i).index;
+    }
+    // several readers per device take turns piece by piece
+    if (m_readers > 1)
+    {
+        QList<QList<qint64> > split;
+        for (auto q = queues.constBegin(); q != queues.constEnd(); ++q)
+        {
+            QList<QList<qint64> > parts(m_readers);
+            for (int x = 0; x < (*q).size(); ++x)
+                parts[x % m_readers] << (*q).at(x);
+            split += parts;
+        }
+        queues = split;
+    }
+
+    m_hashtasks = QList<HashTask *>(plan.size(), 0);
+    std::atomic<qint64> readsize{0};
+    std::atomic<bool> failed{false};
+    qint64 failedpiece = -1;
+    QMutex slotmutex;
+    // zeroHash() is computed lazily, do it once before the readers share it
+    const QByteArray& zerohash = zeroHash();
+    QThreadPool readers;
+    readers.setMaxThreadCount(qMax(1, int(queues.size())));
+    for (auto q = queues.constBegin(); q != queues.constEnd(); ++q)
+    {
+        if ((*q).isEmpty())
+            continue;
+        QList<qint64> queue = *q;
+        readers.start([&, queue]()
+        {
+            if (m_trace)
+                m_trace->nameThread("reader");
+            PieceReader reader(this);
+            for (auto i = queue.constBegin(); i != queue.constEnd() && !m_stop && !failed; ++i)
+            {
+                // with AF_ALG the workers splice the data themselves, the reader only hands out pieces
+                if (m_kernel)
+                {
+                    HashTask* h = new HashTask(pieceRanges(*i));
+                    slotmutex.lock();
+                    m_hashtasks[*i - firstpiece] = h;
+                    slotmutex.unlock();
+                    readsize += qMin(m_piecesize, m_contentlength - *i * m_piecesize);
+                    startTask(h, *i);
+                    continue;
+                }
+                qint64 readbegin = m_trace ? m_trace->now() : 0;
+                bool hole = false;
+                QByteArray ba = reader.read(*i, &hole);
+                if (m_trace && !hole)
+                    m_trace->add("read", "io", readbegin, m_trace->now(), *i);
+                if (ba.isEmpty() && !hole)
+                {
+                    QMutexLocker lock(&slotmutex);
+                    failedpiece = *i;
+                    failed = true;
+                    return;
+                }
+                if (i +1 != queue.constEnd())
+                    reader.willNeed(*(i +1));
+                HashTask* h = new HashTask(ba, m_zerocheck ? zerohash : QByteArray(), m_piecesize);
+                // pieces inside a hole are neither read nor hashed
+                if (hole)
+                {
+                    h->result = zerohash;
+                    h->finished = true;
+                }
+                slotmutex.lock();
+                m_hashtasks[*i - firstpiece] = h;
+                slotmutex.unlock();
+                readsize += hole ? m_piecesize : ba.length();
+                if (!hole)
+                    startTask(h, *i);
+            }
+        });
+    }
+
+    qint64 startsize = donesize;
+    bool finished = false;
+    while (!finished)
+    {
+        finished = readers.waitForDone(100);
+        if (checkpointtimer.isValid() && checkpointtimer.elapsed() > 30000)
+        {
+            slotmutex.lock();
+            writeCheckpoint(fp);
+            slotmutex.unlock();
+            checkpointtimer.restart();
+        }
+        donesize = startsize + readsize;
+        int pg = (double)donesize / (double)m_contentlength *100;
+        if (pg != progress)
+        {
+            progress = pg;
+            emit progressUpdate(progress);
+        }
+    }
+    if (failed)
+    {
+        throwerror("Can't read piece " + QString::number(failedpiece) + ", files have been changed or removed. Operation aborted!");
+        return false;
+    }
+    return true;
+}
+
+void TorrentFileHasher::watchFollowed(const QString &filename)
+{
+    m_followdone = !m_endmarker.isEmpty() && QFile::exists(m_endmarker);
+    m_inotify = inotify_init1(IN_CLOEXEC);
+    if (m_inotify < 0)
+        return;
+    inotify_add_watch(m_inotify, QFile::encodeName(filename).constData(), IN_MODIFY | IN_CLOSE_WRITE);
+    if (!m_endmarker.isEmpty())
+        inotify_add_watch(m_inotify, QFile::encodeName(QFileInfo(m_endmarker).absolutePath()).constData(), IN_CREATE | IN_MOVED_TO);
+}
+
+void TorrentFileHasher::waitForGrowth()
+{
+    pollfd p{m_inotify, POLLIN, 0};
+    if (m_inotify < 0)
+        QThread::msleep(1000);
+    else if (poll(&p, 1, 1000) > 0)
+    {
+        alignas(inotify_event) char buffer[4096];
+        ssize_t n = ::read(m_inotify, buffer, sizeof(buffer));
+        for (ssize_t pos = 0; pos < n; pos += sizeof(inotify_event) + reinterpret_cast<inotify_event*>(buffer + pos)->len)
+            if (reinterpret_cast<inotify_event*>(buffer + pos)->mask & IN_CLOSE_WRITE)
+                m_followdone = true;
+    }
+    if (!m_endmarker.isEmpty() && QFile::exists(m_endmarker))
+        m_followdone = true;
+}
+
 TorrentFile::TorrentFile(QObject *parent) : QObject(parent)
 {
     m_data = QVariantMap{{"info", QVariantMap()}};
@@ -62,7 +732,7 @@ bool TorrentFile::load(const QString &filename, DATATYPE keytype)
     return false;
 }
 
-bool TorrentFile::create(const QString &filename)
+bool TorrentFile::create(const QString &filename, bool resume)
 {
     if (m_hashthread)
         return false;
@@ -71,13 +741,48 @@ bool TorrentFile::create(const QString &filename)
         setAutomaticPieceLength();
 
     m_outputfile.setFileName(filename);
-    if (!m_outputfile.open(QIODevice::WriteOnly) || !m_outputfile.resize(calculateTorrentfileSize()))
+    if (m_split.isEmpty() && !m_shards && (!m_outputfile.open(QIODevice::WriteOnly) || !m_outputfile.resize(calculateTorrentfileSize())))
         return false;
 
+    m_mtimes.clear();
+    for (auto i = m_filelist.constBegin(); i != m_filelist.constEnd(); ++i)
+        m_mtimes << ((*i).first.isEmpty() ? 0 : QFileInfo((*i).first).lastModified().toSecsSinceEpoch());
+
     m_hasher = new TorrentFileHasher(m_filelist, getPieceLength(), getContentLength());
+    m_hasher->setCheckpoint(filename + ".stcresume", resume);
+    m_hasher->setPhysicalOrder(m_physical);
+    m_hasher->setReaderCount(m_readers);
+    m_hasher->setKernelHash(m_kernel);
+    m_hasher->setZeroCheck(m_zerocheck);
+    if (m_shards)
+    {
+        qint64 n = getPieceNumber();
+        m_hasher->setRange(m_shard * n / m_shards, (m_shard + 1) * n / m_shards);
+    }
+    if (!m_split.isEmpty())
+    {
+        QList<int> firstfiles;
+        for (auto i = m_split.constBegin(); i != m_split.constEnd(); ++i)
+            firstfiles << (*i).first;
+        m_hasher->setSegments(firstfiles);
+    }
+    m_hasher->setWorkerCount(m_workers);
+    if (!m_tracefile.isEmpty())
+        m_hasher->setTrace(m_tracefile);
+    if (m_follow)
+        m_hasher->setFollow(m_endmarker);
+    if (m_checksum == "sha1")
+        m_hasher->setFileDigest(QCryptographicHash::Sha1);
+    else if (m_checksum == "md5")
+        m_hasher->setFileDigest(QCryptographicHash::Md5);
+    else if (m_checksum == "sha256")
+        m_hasher->setFileDigest(QCryptographicHash::Sha256);
     m_hashthread = new QThread(this);
     m_hasher->moveToThread(m_hashthread);
     connect(m_hasher, &TorrentFileHasher::progressUpdate, this, &TorrentFile::progress, Qt::QueuedConnection);
+    connect(m_hasher, &TorrentFileHasher::streamEnded, this, &TorrentFile::onStreamEnded, Qt::QueuedConnection);
+    connect(m_hasher, &TorrentFileHasher::fileDigests, this, &TorrentFile::onFileDigests, Qt::QueuedConnection);
+    connect(m_hasher, &TorrentFileHasher::checkpointDiscarded, this, &TorrentFile::checkpointDiscarded, Qt::QueuedConnection);
     connect(m_hasher, &TorrentFileHasher::done, this, &TorrentFile::onThreadFinished, Qt::QueuedConnection);
     connect(m_hasher, &TorrentFileHasher::error, this, &TorrentFile::error);
     connect(m_hashthread, &QThread::started, m_hasher, &TorrentFileHasher::hash, Qt::QueuedConnection);
@@ -126,9 +831,35 @@ void TorrentFile::setFile(const QString &filename)
         m_parentdir += "/";
 }
 
-void TorrentFile::setDirectory(const QString &path)
+void TorrentFile::setStream(const QString &name)
 {
     resetFiles();
+
+    QVariantMap m = m_data.value("info").toMap();
+    m.remove("files");
+    m_filelist.append(QPair<QString, qint64>("-", 0));
+    m.insert("name", name);
+    m_realname = name;
+    m.insert("length", 0);
+    m_data.insert("info", m);
+    m_parentdir = "";
+}
+
+void TorrentFile::setFollow(const QString &filename, const QString &endmarker)
+{
+    setFile(filename);
+    QVariantMap m = m_data.value("info").toMap();
+    m.insert("length", 0);
+    m_data.insert("info", m);
+    m_filelist.first().second = 0;
+    m_follow = true;
+    m_endmarker = endmarker;
+}
+
+void TorrentFile::setDirectory(const QString &path, bool padded)
+{
+    resetFiles();
+    m_padded = padded;
     m_parentdir = path.left(path.lastIndexOf('/', -2) +1);
 
     QVariantMap m = m_data.value("info").toMap();
@@ -142,6 +873,7 @@ void TorrentFile::setDirectory(const QString &path)
         files.append(QVariantMap{{"length", (*i).second}, {"path", dir.relativeFilePath((*i).first).split("/")}});
     m.insert("files", files);
     m_data.insert("info", m);
+    updatePadding();
 
     QStringList watchdirs(path);
     QDirIterator dirsit(path, QDir::Dirs | QDir::NoSymLinks | QDir::NoDotAndDotDot, QDirIterator::Subdirectories);
@@ -169,7 +901,7 @@ void TorrentFile::setRootDirectory(const QString &path)
         for (auto i = files.constBegin(); i != files.constEnd(); ++i)
         {
             QVariantMap m = (*i).toMap();
-            QString path = root + m.value("path").toStringList().join("/");
+            QString path = m.value("attr").toString().contains('p') ? QString() : root + m.value("path").toStringList().join("/");
             qint64 length = m.value("length").toLongLong();
             m_filelist.append(QPair<QString, qint64>(path, length));
         }
@@ -186,6 +918,84 @@ void TorrentFile::setRootDirectory(const QString &path)
 
 }
 
+QList<TorrentFile::VerifyResult> TorrentFile::verify(qint64 count, quint32 seed)
+{
+    QList<VerifyResult> res;
+    QByteArray pieces = getPieces();
+    qint64 piecelength = getPieceLength();
+    qint64 contentlength = 0;
+    for (auto i = m_filelist.constBegin(); i != m_filelist.constEnd(); ++i)
+        contentlength += (*i).second;
+    qint64 n = pieces.size() / 20;
+    if (!piecelength || !n || n != (contentlength + piecelength -1) / piecelength)
+        return res;
+
+    QSet<qint64> picked;
+    if (count <= 0 || count >= n)
+        for (qint64 i = 0; i < n; ++i)
+            picked.insert(i);
+    else
+    {
+        QRandomGenerator rng(seed);
+        for (qint64 i = 0; i < count; ++i)
+        {
+            qint64 begin = i * n / count, end = (i +1) * n / count;
+            picked.insert(begin + qint64(rng.bounded(quint64(end - begin))));
+        }
+    }
+    QList<qint64> indices = picked.values();
+    std::sort(indices.begin(), indices.end());
+
+    // small files can fall between the picks, they get a piece of their own
+    QList<qint64> extra;
+    qint64 offset = 0;
+    auto next = indices.constBegin();
+    QRandomGenerator rng(seed ^ 0x5a5a5a5a);
+    for (auto i = m_filelist.constBegin(); i != m_filelist.constEnd(); ++i)
+    {
+        qint64 first = offset / piecelength, last = (offset + (*i).second -1) / piecelength;
+        offset += (*i).second;
+        if ((*i).first.isEmpty() || !(*i).second)
+            continue;
+        while (next != indices.constEnd() && (*next) < first)
+            ++next;
+        if (next == indices.constEnd() || (*next) > last)
+            extra << first + qint64(rng.bounded(quint64(last - first +1)));
+    }
+    if (!extra.isEmpty())
+    {
+        indices += extra;
+        std::sort(indices.begin(), indices.end());
+        indices.erase(std::unique(indices.begin(), indices.end()), indices.end());
+    }
+
+    TorrentFileHasher hasher(m_filelist, piecelength, contentlength);
+    QList<QByteArray> hashes = hasher.hashPieces(indices);
+
+    // pieces spanning several files count for all of them
+    offset = 0;
+    auto piece = indices.constBegin();
+    for (auto i = m_filelist.constBegin(); i != m_filelist.constEnd(); ++i)
+    {
+        qint64 fbegin = offset;
+        offset += (*i).second;
+        if ((*i).first.isEmpty())
+            continue;
+        VerifyResult r;
+        r.path = (*i).first;
+        while (piece != indices.constEnd() && ((*piece) +1) * piecelength <= fbegin)
+            ++piece;
+        for (auto x = piece; x != indices.constEnd() && (*x) * piecelength < offset && (*i).second; ++x)
+        {
+            ++r.checked;
+            if (hashes.at(x - indices.constBegin()) != pieces.mid((*x) * 20, 20))
+                ++r.failed;
+        }
+        res << r;
+    }
+    return res;
+}
+
 void TorrentFile::abortHashing()
 {
     if (m_hashthread)
@@ -241,12 +1051,11 @@ QVariant TorrentFile::getAdditionalData() const
     for (auto i = files.constBegin(); i != files.constEnd(); ++i)
     {
         QVariantMap fmap = (*i).toMap();
-        if (fmap.size() > 2)
-        {
-            fmap.remove("path");
-            fmap.remove("length");
+        fmap.remove("path");
+        fmap.remove("length");
+        fmap.remove("attr");
+        if (!fmap.isEmpty())
             filesnew.append(fmap);
-        }
     }
 
 
@@ -329,6 +1138,7 @@ void TorrentFile::setPieceLength(const qint64 &bytes)
     QVariantMap m = m_data.value("info").toMap();
     m.insert("piece length", bytes);
     m_data.insert("info", m);
+    updatePadding();
 }
 
 void TorrentFile::setPrivate(const bool &is_private)
@@ -369,7 +1179,7 @@ QVariant TorrentFile::decodeBencode(const QByteArray& bencode, DATATYPE keytype,
                     if (standardkeys.value(key, ADDITIONAL) <= keytype)
                     {
                         // assume string, unless we know it's bytes
-                        if (key == "pieces" || key == "pieces root")
+                        if (key == "pieces" || key == "pieces root" || key == "sha1")
                         {
                             cmap.insert(key, s);
                         }
@@ -436,7 +1246,7 @@ QVariant TorrentFile::decodeBencode(const QByteArray& bencode, DATATYPE keytype,
     return ret;
 }
 
-QByteArray TorrentFile::encode(const QVariant &data, const bool createinfohash)
+QByteArray TorrentFile::encodeBencode(const QVariant &data, QByteArray *infohash)
 {
     switch (data.typeId())
     {
@@ -451,10 +1261,10 @@ QByteArray TorrentFile::encode(const QVariant &data, const bool createinfohash)
             QByteArray ret = "d";
             for (auto i = data.toMap().constBegin(); i != data.toMap().constEnd(); ++i)
             {
-                QByteArray val = encode(i.value(), createinfohash);
-                if (i.key() == "info" && createinfohash)
-                    m_infohash = QCryptographicHash::hash(val, QCryptographicHash::Sha1);
-                ret += encode(i.key(), createinfohash) + val;
+                QByteArray val = encodeBencode(i.value(), infohash);
+                if (i.key() == "info" && infohash)
+                    *infohash = QCryptographicHash::hash(val, QCryptographicHash::Sha1);
+                ret += encodeBencode(i.key(), infohash) + val;
             }
             ret += "e";
             return ret;
@@ -464,7 +1274,7 @@ QByteArray TorrentFile::encode(const QVariant &data, const bool createinfohash)
             QStringList l = data.toStringList();
             QByteArray ret = "l";
             for (auto i = l.constBegin(); i != l.constEnd(); ++i)
-                ret += encode(*i, createinfohash);
+                ret += encodeBencode(*i, infohash);
             ret += "e";
             return ret;
         }
@@ -472,28 +1282,63 @@ QByteArray TorrentFile::encode(const QVariant &data, const bool createinfohash)
         {
             QByteArray ret = "l";
             for (auto i = data.toList().constBegin(); i != data.toList().constEnd(); ++i)
-                ret += encode(*i, createinfohash);
+                ret += encodeBencode(*i, infohash);
             ret += "e";
             return ret;
         }
     }
 }
 
+void TorrentFile::updatePadding()
+{
+    if (!m_padded)
+        return;
+
+    qint64 piecelength = getPieceLength();
+    QVariantMap m = m_data.value("info").toMap();
+    QVariantList files = m.value("files").toList();
+    QVariantList newfiles;
+    QList<QPair<QString, qint64> > filelist;
+    for (int i = 0; i < files.size() && i < m_filelist.size(); ++i)
+    {
+        if (m_filelist.at(i).first.isEmpty())
+            continue;
+        newfiles << files.at(i);
+        filelist << m_filelist.at(i);
+        qint64 pad = piecelength ? (piecelength - m_filelist.at(i).second % piecelength) % piecelength : 0;
+        if (pad && i != files.size() -1)
+        {
+            newfiles << QVariantMap{{"attr", "p"}, {"length", pad}, {"path", QStringList{".pad", QString::number(pad)}}};
+            filelist << QPair<QString, qint64>(QString(), pad);
+        }
+    }
+    m_filelist = filelist;
+    m.insert("files", newfiles);
+    m_data.insert("info", m);
+}
+
 void TorrentFile::resetFiles()
 {
     m_filelist.clear();
+    m_padded = false;
+    m_follow = false;
+    m_split.clear();
     if (!m_watcher.directories().isEmpty())
         m_watcher.removePaths(m_watcher.directories());
 }
 
-QList<QPair<QString, qint64> > TorrentFile::getFilesFromFolder(QString path)
+QList<QPair<QString, qint64> > TorrentFile::getFilesFromFolder(QString path, QStringList parents)
 {
     QList<QPair<QString, qint64> > res;
     QDir dir(path);
-    QFileInfoList fil = dir.entryInfoList(QDir::Dirs | QDir::NoDotAndDotDot | QDir::NoSymLinks, QDir::Name);
+    // subfolders symlinked from other disks are part of the content, a link back up would never end
+    parents << dir.canonicalPath();
+    QFileInfoList fil = dir.entryInfoList(QDir::Dirs | QDir::NoDotAndDotDot, QDir::Name);
     for (auto i = fil.constBegin(); i != fil.constEnd(); ++i)
     {
-        QList<QPair<QString, qint64> > r = getFilesFromFolder((*i).absoluteFilePath());
+        if ((*i).isSymLink() && parents.contains((*i).canonicalFilePath()))
+            continue;
+        QList<QPair<QString, qint64> > r = getFilesFromFolder((*i).absoluteFilePath(), parents);
         res.append(r);
     }
 
@@ -519,6 +1364,16 @@ void TorrentFile::onWatchedDirChanged(const QString &dir)
 qint64 TorrentFile::setAutomaticPieceLength()
 {
     qint64 contentsize = getContentLength();
+    for (auto i = m_filelist.constBegin(); i != m_filelist.constEnd(); ++i)
+        if ((*i).first.isEmpty())
+            contentsize -= (*i).second;
+    // split torrents share the piece length, the largest part decides
+    if (!m_split.isEmpty())
+    {
+        contentsize = 0;
+        for (auto i = m_split.constBegin(); i != m_split.constEnd(); ++i)
+            contentsize = qMax(contentsize, (*i).second);
+    }
     qint64 piecesize = 16*1024;
     qint64 piecenum = (contentsize / piecesize) +1;
     qint64 maxpsize = 16 *1024 *1024;
@@ -538,9 +1393,157 @@ qint64 TorrentFile::setAutomaticPieceLength()
     QVariantMap m = m_data.value("info").toMap();
     m.insert("piece length", piecesize);
     m_data.insert("info", m);
+    updatePadding();
     return piecesize;
 }
 
+QByteArray TorrentFile::shardFingerprint() const
+{
+    QVariantMap info = m_data.value("info").toMap();
+    info.remove("pieces");
+    return QCryptographicHash::hash(encodeBencode(info), QCryptographicHash::Sha1);
+}
+
+bool TorrentFile::merge(const QString &filename, const QStringList &shards)
+{
+    if (m_hashthread)
+        return false;
+    qint64 n = getPieceNumber();
+    QString fingerprint = shardFingerprint().toHex();
+    QMap<int, QByteArray> parts;
+    int count = 0;
+    for (auto i = shards.constBegin(); i != shards.constEnd(); ++i)
+    {
+        QFile f(*i);
+        if (!f.open(QIODevice::ReadOnly))
+        {
+            emit error("Can't read shard: " + (*i));
+            return false;
+        }
+        QByteArray data = f.readAll();
+        QVariantMap shard = data.startsWith('d') ? decodeBencode(data).toMap() : QVariantMap();
+        int index = shard.value("index", -1).toInt();
+        count = count ? count : shard.value("count").toInt();
+        QByteArray pieces = shard.value("pieces").toByteArray();
+        qint64 first = count ? index * n / count : -1;
+        if (shard.value("fingerprint").toString() != fingerprint || shard.value("count").toInt() != count || index < 0 || index >= count
+                || shard.value("first piece").toLongLong() != first || pieces.size() != ((index + 1) * n / count - first) * 20)
+        {
+            emit error("Shard " + (*i) + " doesn't belong to this torrent (different files or settings).");
+            return false;
+        }
+        parts.insert(index, pieces);
+    }
+    if (!count || parts.size() != count)
+    {
+        emit error(QString("Only %1 of %2 shards found.").arg(parts.size()).arg(count));
+        return false;
+    }
+
+    QByteArray pieces;
+    for (auto i = parts.constBegin(); i != parts.constEnd(); ++i)
+        pieces += i.value();
+    m_outputfile.setFileName(filename);
+    if (!m_outputfile.open(QIODevice::WriteOnly))
+    {
+        emit error("Could not write to file: " + filename);
+        return false;
+    }
+    QMetaObject::invokeMethod(this, [this, pieces]() {onThreadFinished(pieces);}, Qt::QueuedConnection);
+    return true;
+}
+
+int TorrentFile::setSplit(qint64 maxsize)
+{
+    m_split.clear();
+    for (int i = 0; i < m_filelist.size(); ++i)
+    {
+        if (m_split.isEmpty() || (m_split.last().second && m_split.last().second + m_filelist.at(i).second > maxsize))
+            m_split << QPair<int, qint64>(i, 0);
+        m_split.last().second += m_filelist.at(i).second;
+    }
+    return m_split.size();
+}
+
+QString TorrentFile::splitFileName(const QString &filename, int group)
+{
+    QString base = filename;
+    if (base.endsWith(".torrent", Qt::CaseInsensitive))
+        base.chop(8);
+    return base + ".part" + QString::number(group + 1) + ".torrent";
+}
+
+QString TorrentFile::writeSplit(const QByteArray &pieces)
+{
+    m_splitresults.clear();
+    QVariantMap info = m_data.value("info").toMap();
+    QVariantList files = info.value("files").toList();
+    qint64 piecelength = getPieceLength();
+    qint64 pos = 0;
+    for (int g = 0; g < m_split.size(); ++g)
+    {
+        int first = m_split.at(g).first;
+        int last = g + 1 < m_split.size() ? m_split.at(g + 1).first : files.size();
+        qint64 n = (m_split.at(g).second + piecelength -1) / piecelength;
+        QVariantMap m = info;
+        m.insert("files", files.mid(first, last - first));
+        m.insert("pieces", pieces.mid(pos * 20, n * 20));
+        pos += n;
+        QVariantMap data = m_data;
+        data.insert("info", m);
+
+        QByteArray infohash;
+        QByteArray bcode = encodeBencode(data, &infohash);
+        QString filename = splitFileName(m_outputfile.fileName(), g);
+        QSaveFile f(filename);
+        if (!f.open(QIODevice::WriteOnly) || f.write(bcode) == -1 || !f.commit())
+            return "Could not write to file: " + filename;
+        m_splitresults << QPair<QString, QByteArray>(filename, infohash.toHex());
+    }
+    return QString();
+}
+
+TorrentFile::Plan TorrentFile::plan(qint64 maxsize, qint64 piececount, bool choosepiecelength)
+{
+    Plan res;
+    qint64 contentsize = getContentLength();
+    if (choosepiecelength && piececount > 0)
+    {
+        // powers of two from 16 KiB to 64 MiB, the one with the piece count closest on a log scale
+        qint64 best = 16 *1024;
+        for (qint64 piecesize = best; piecesize <= 64 *1024 *1024; piecesize *= 2)
+            if (qAbs(std::log(double(contentsize / piecesize +1) / piececount)) < qAbs(std::log(double(contentsize / best +1) / piececount)))
+                best = piecesize;
+        setPieceLength(best);
+    }
+    else if (choosepiecelength)
+        setAutomaticPieceLength();
+    while (choosepiecelength && maxsize > 0 && calculateTorrentfileSize() > maxsize && getPieceLength() < 64 *1024 *1024)
+        setPieceLength(getPieceLength() * 2);
+    res.piecelength = getPieceLength();
+    res.metainfosize = calculateTorrentfileSize();
+
+    TorrentFileHasher calibration(m_filelist, res.piecelength, contentsize);
+    res.hashrate = TorrentFileHasher::measureHashRate();
+    res.kernelrate = KernelSha1::measureHashRate();
+    // the backend is the caller's choice, the calibration only reports both
+    res.kernelsha1 = m_kernel && res.kernelrate > 0;
+    if (res.kernelsha1)
+        res.hashrate = res.kernelrate;
+    double single = calibration.measureReadRate(1, 64 *1024 *1024, 0);
+    double parallel = calibration.measureReadRate(4, 64 *1024 *1024, 1);
+    // rotational disks get slower with concurrent readers, only take them if they clearly pay off
+    res.readers = parallel > single * 1.3 ? 4 : 1;
+    res.readrate = res.readers > 1 ? parallel : single;
+    int cores = qMax(1, QThread::idealThreadCount());
+    res.workers = res.readrate > 0 ? qBound(1, int(std::ceil(res.readrate / qMax(1.0, res.hashrate))), cores) : cores;
+    double rate = qMin(res.readrate, res.workers * res.hashrate);
+    res.duration = rate > 0 ? qint64(contentsize / rate * 1000) : 0;
+    m_readers = res.readers;
+    m_workers = res.workers;
+    return res;
+}
+
 void TorrentFile::dupe()
 {
     QVariantMap m = m_data.value("info").toMap();
@@ -548,6 +1551,90 @@ void TorrentFile::dupe()
     m_data.insert("info", m);
 }
 
+bool TorrentFile::setFileChecksum(const QString &type, const QString &sidecar)
+{
+    if (!type.isEmpty() && type != "sha1" && type != "md5" && type != "sha256")
+        return false;
+    m_checksum = type;
+    m_checksumfile = sidecar;
+
+    QByteArray placeholder;
+    if (type == "sha1")
+        placeholder = QByteArray(20, '\0');
+    else if (type == "md5")
+        placeholder = QByteArray(32, '0');
+    QString key = type == "sha1" ? "sha1" : "md5sum";
+
+    QVariantMap m = m_data.value("info").toMap();
+    QVariantList files = m.value("files").toList();
+    m.remove("sha1");
+    m.remove("md5sum");
+    if (files.isEmpty() && !placeholder.isEmpty())
+        m.insert(key, type == "sha1" ? QVariant(placeholder) : QVariant(QString(placeholder)));
+    for (int i = 0; i < files.size(); ++i)
+    {
+        QVariantMap f = files.at(i).toMap();
+        f.remove("sha1");
+        f.remove("md5sum");
+        if (!placeholder.isEmpty() && !f.value("attr").toString().contains('p'))
+            f.insert(key, type == "sha1" ? QVariant(placeholder) : QVariant(QString(placeholder)));
+        files[i] = f;
+    }
+    if (!files.isEmpty())
+        m.insert("files", files);
+    m_data.insert("info", m);
+    return true;
+}
+
+void TorrentFile::onFileDigests(QByteArrayList digests)
+{
+    QVariantMap m = m_data.value("info").toMap();
+    QVariantList files = m.value("files").toList();
+    QString name = m.value("name").toString();
+    QByteArray sums;
+    for (int i = 0; i < digests.size(); ++i)
+    {
+        if (digests.at(i).isEmpty())
+            continue;
+        QVariantMap f = files.value(i).toMap();
+        if (files.isEmpty())
+        {
+            if (m.contains("sha1"))
+                m.insert("sha1", digests.at(i));
+            if (m.contains("md5sum"))
+                m.insert("md5sum", QString(digests.at(i).toHex()));
+            sums += digests.at(i).toHex() + "  " + name.toUtf8() + "\n";
+        }
+        else
+        {
+            if (f.contains("sha1"))
+                f.insert("sha1", digests.at(i));
+            if (f.contains("md5sum"))
+                f.insert("md5sum", QString(digests.at(i).toHex()));
+            files[i] = f;
+            sums += digests.at(i).toHex() + "  " + (name + "/" + f.value("path").toStringList().join("/")).toUtf8() + "\n";
+        }
+    }
+    if (!files.isEmpty())
+        m.insert("files", files);
+    m_data.insert("info", m);
+
+    if (!m_checksumfile.isEmpty())
+    {
+        QSaveFile f(m_checksumfile);
+        if (!f.open(QIODevice::WriteOnly) || f.write(sums) == -1 || !f.commit())
+            emit error("Could not write to file: " + m_checksumfile);
+    }
+}
+
+void TorrentFile::onStreamEnded(qint64 length)
+{
+    QVariantMap m = m_data.value("info").toMap();
+    m.insert("length", length);
+    m_data.insert("info", m);
+    m_filelist.first().second = length;
+}
+
 void TorrentFile::onThreadFinished(QByteArray pieces)
 {
     if (m_hashthread)
@@ -557,11 +1644,41 @@ void TorrentFile::onThreadFinished(QByteArray pieces)
         m_hashthread->deleteLater();
         m_hashthread = 0;
     }
+    if (m_shards)
+    {
+        // the partial pieces go to a bencoded shard file, merge() puts them together
+        qint64 n = getPieceNumber();
+        QVariantMap shard{
+            {"fingerprint", QString(shardFingerprint().toHex())},
+            {"index", m_shard},
+            {"count", m_shards},
+            {"first piece", m_shard * n / m_shards},
+            {"pieces", pieces}
+        };
+        QSaveFile f(m_outputfile.fileName());
+        bool ok = f.open(QIODevice::WriteOnly) && f.write(encodeBencode(shard)) != -1 && f.commit();
+        if (!ok)
+            emit error("Could not write to file: " + m_outputfile.fileName());
+        emit finished(ok);
+        return;
+    }
+
+    if (!m_split.isEmpty())
+    {
+        QString msg = writeSplit(pieces);
+        if (!msg.isEmpty())
+            emit error(msg);
+        emit finished(msg.isEmpty());
+        return;
+    }
+
     QVariantMap m = m_data.value("info").toMap();
     m.insert("pieces", pieces);
     m_data.insert("info", m);
 
-    if (m_outputfile.write(encode(m_data, 1)) == -1)
+    // the size reserved in create() is only an estimate if the length wasn't known
+    QByteArray bcode = encode(m_data, 1);
+    if (m_outputfile.write(bcode) == -1 || !m_outputfile.resize(bcode.size()))
     {
         emit error("Could not write to file: " + m_outputfile.fileName());
         emit finished(false);
@@ -569,10 +1686,104 @@ void TorrentFile::onThreadFinished(QByteArray pieces)
     else
     {
         m_outputfile.close();
+        QString msg = writeResumeData();
+        if (!msg.isEmpty())
+            emit error(msg);
         emit finished(true);
     }
 }
 
+QString TorrentFile::writeResumeData()
+{
+    if (m_fastresume.isEmpty() && m_rtorrentresume.isEmpty())
+        return QString();
+    for (int i = 0; i < m_filelist.size(); ++i)
+        if (!m_filelist.at(i).first.isEmpty() && QFileInfo(m_filelist.at(i).first).lastModified().toSecsSinceEpoch() != m_mtimes.value(i))
+            return "Files have been changed while hashing, no resume data written.";
+
+    QVariantMap info = m_data.value("info").toMap();
+    QVariantList files = info.value("files").toList();
+    qint64 piecelength = getPieceLength();
+    qint64 pieces = info.value("pieces").toByteArray().size() / 20;
+    qint64 now = QDateTime::currentSecsSinceEpoch();
+    QString name = info.value("name").toString();
+    // the clients load the resume data from their own working directory
+    QString savepath = QDir::cleanPath(QDir::current().absoluteFilePath(m_parentdir));
+
+    if (!m_fastresume.isEmpty())
+    {
+        QVariantList sizes;
+        for (int i = 0; i < m_filelist.size(); ++i)
+            sizes << QVariant(QVariantList{m_filelist.at(i).second, m_mtimes.value(i)});
+        QVariantMap resume{
+            {"file-format", "libtorrent resume file"},
+            {"file-version", 1},
+            {"info-hash", m_infohash},
+            {"pieces", QByteArray(pieces, '\x01')},
+            {"file_sizes", sizes},
+            {"save_path", savepath},
+            {"added_time", now},
+            {"completed_time", now},
+            {"paused", 0},
+            {"auto_managed", 1}
+        };
+        // content created under another name: point the files at their real location
+        if (name != m_realname)
+        {
+            QVariantList mapped;
+            if (files.isEmpty())
+                mapped << m_realname;
+            for (auto i = files.constBegin(); i != files.constEnd(); ++i)
+            {
+                QStringList path = (*i).toMap().value("path").toStringList();
+                mapped << QString(m_realname + "/" + path.join("/"));
+            }
+            resume.insert("mapped_files", mapped);
+        }
+        QSaveFile f(m_fastresume);
+        if (!f.open(QIODevice::WriteOnly) || f.write(encodeBencode(resume)) == -1 || !f.commit())
+            return "Could not write to file: " + m_fastresume;
+    }
+
+    if (!m_rtorrentresume.isEmpty())
+    {
+        if (files.isEmpty() && name != m_realname)
+            return "rTorrent can't load a renamed single file torrent from its original location, no resume data written.";
+        // rTorrent counts the chunks a file touches as completed
+        QVariantList resumefiles;
+        qint64 offset = 0;
+        for (int i = 0; i < m_filelist.size(); ++i)
+        {
+            qint64 length = m_filelist.at(i).second;
+            qint64 chunks = length ? (offset + length - 1) / piecelength - offset / piecelength + 1 : 0;
+            resumefiles << QVariantMap{{"completed", chunks}, {"mtime", m_mtimes.value(i)}, {"priority", 1}};
+            offset += length;
+        }
+        QVariantMap data = m_data;
+        data.insert("libtorrent_resume", QVariantMap{
+            {"bitfield", pieces},
+            {"files", resumefiles},
+            {"uncertain_pieces.timestamp", now}
+        });
+        data.insert("rtorrent", QVariantMap{
+            {"chunks_done", pieces},
+            {"chunks_wanted", 0},
+            {"complete", 1},
+            {"directory", files.isEmpty() ? savepath : QDir(savepath).filePath(m_realname)},
+            {"hashing", 0},
+            {"state", 1},
+            {"state_changed", now},
+            {"state_counter", 1},
+            {"timestamp.finished", now},
+            {"timestamp.started", now}
+        });
+        QSaveFile f(m_rtorrentresume);
+        if (!f.open(QIODevice::WriteOnly) || f.write(encodeBencode(data)) == -1 || !f.commit())
+            return "Could not write to file: " + m_rtorrentresume;
+    }
+    return QString();
+}
+
 void TorrentFile::onHashError(QString msg)
 {
     if (m_outputfile.isOpen())
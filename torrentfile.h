@@ -5,6 +5,7 @@
 #include <QFile>
 #include <QCryptographicHash>
 #include <QVariant>
+#include <QByteArrayList>
 #include <QFileInfo>
 #include <QDir>
 #include <QDirIterator>
@@ -13,23 +14,173 @@
 #include <QMutex>
 #include <QFileSystemWatcher>
 #include <QDateTime>
+#include <QElapsedTimer>
+#include <QSemaphore>
+#include <QSet>
+#include <QHash>
 
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <vector>
+#include <unistd.h>
 
-//! QRunnable reimplementation to create SHA1 hashes.
+
+//! Collects timed events of a hashing run and writes them in the Chrome trace event format, viewable in chrome://tracing or ui.perfetto.dev. Thread safe. Code only calls it if a trace was requested, so disabled tracing costs a pointer check.
+class HashTrace
+{
+public:
+    HashTrace() {m_timer.start();}
+    //! Microseconds since the trace started.
+    qint64 now() const {return m_timer.nsecsElapsed() / 1000;}
+    //! Records a complete event from begin to end on the calling thread. piece < 0 and an empty detail are left out.
+    void add(const char* name, const char* category, qint64 begin, qint64 end, qint64 piece = -1, const QString& detail = QString())
+    {
+        Event e{name, category, begin, end - begin, threadId(), piece, detail};
+        QMutexLocker lock(&m_mutex);
+        m_events << e;
+    }
+    //! Names the calling thread in the viewer, only the first name of a thread is kept.
+    void nameThread(const char* name)
+    {
+        int tid = threadId();
+        QMutexLocker lock(&m_mutex);
+        if (!m_threads.contains(tid))
+            m_threads.insert(tid, name);
+    }
+    //! @return false if filename can't be written.
+    bool write(const QString& filename) const;
+
+private:
+    struct Event
+    {
+        const char* name;
+        const char* category;
+        qint64 begin, duration;
+        int tid;
+        qint64 piece;
+        QString detail;
+    };
+    QElapsedTimer m_timer;
+    mutable QMutex m_mutex;
+    QList<Event> m_events;
+    QHash<int, const char*> m_threads;
+
+    //! Small sequential ids are easier to read than native thread handles.
+    static int threadId()
+    {
+        static std::atomic<int> counter{0};
+        thread_local int id = ++counter;
+        return id;
+    }
+};
+
+
+//! SHA1 through the kernel crypto API (AF_ALG). File data is spliced from the page cache into the hash socket, it's never copied to user space and accelerated kernel drivers are used if there are any. Instances aren't thread safe, use local() for one per thread.
+class KernelSha1
+{
+public:
+    //! A range of a file to hash. An empty path stands for zeros (padding files), size is the expected file size, checked if >= 0.
+    struct Range
+    {
+        QString path;
+        qint64 offset, length, size;
+    };
+
+    KernelSha1();
+    ~KernelSha1();
+    KernelSha1(const KernelSha1&) = delete;
+    KernelSha1& operator=(const KernelSha1&) = delete;
+
+    //! The instance of the calling thread.
+    static KernelSha1& local()
+    {
+        thread_local KernelSha1 k;
+        return k;
+    }
+
+    //! True if the kernel offers sha1 over AF_ALG and its result is correct. Probed once.
+    static bool available();
+
+    //! Hashes data from memory. @return an empty QByteArray on failure.
+    QByteArray hash(const QByteArray& data);
+
+    //! Hashes the concatenated ranges, file data goes through a pipe into the hash socket with splice(). @return an empty QByteArray on failure or if a file doesn't have the expected size.
+    QByteArray hash(const QList<Range>& ranges);
+
+    //! Reads the ranges into memory, the fallback if AF_ALG isn't usable. @return an empty QByteArray if a file can't be read or doesn't have the expected size.
+    static QByteArray read(const QList<Range>& ranges);
+
+    //! SHA1 throughput through AF_ALG in bytes per second, hashing from memory for about 200 ms. 0 if not available.
+    static double measureHashRate();
+
+private:
+    int m_tfm = -1, m_op = -1;
+    int m_pipe[2] = {-1, -1};
+
+    QByteArray digest();
+
+    //! A failed operation leaves the socket and pipe in an unknown state, start over with fresh ones.
+    QByteArray reset();
+};
+
+
+//! QRunnable reimplementation to create SHA1 hashes. If zerohash is set, data of the same size made entirely of zeros isn't hashed but gets zerohash as result.
 class HashTask : public QRunnable
 {
 public:
-    explicit HashTask(QByteArray data) : m_data(data) {setAutoDelete(false);}
+    explicit HashTask(QByteArray data, const QByteArray& zerohash = QByteArray(), qint64 zerosize = 0) : m_data(data), m_zerohash(zerohash), m_zerosize(zerosize) {setAutoDelete(false);}
+    //! Hashes file ranges instead of data with KernelSha1, reading them itself if AF_ALG fails. result stays empty if the files can't be read.
+    explicit HashTask(const QList<KernelSha1::Range>& ranges) : m_zerosize(0), m_ranges(ranges) {setAutoDelete(false);}
     QByteArray m_data, result;
+    //! Set once result is valid, can be polled from other threads.
+    std::atomic<bool> finished{false};
+    //! If set the time between queued and the start of run() and the hashing itself are traced for piece.
+    HashTrace* trace = 0;
+    qint64 piece = -1, queued = 0;
     void run()
     {
-        result = QCryptographicHash::hash(m_data, QCryptographicHash::Sha1);
+        qint64 begin = 0;
+        if (trace)
+        {
+            begin = trace->now();
+            trace->nameThread("hash worker");
+            trace->add("queue wait", "wait", queued, begin, piece);
+        }
+        if (!m_ranges.isEmpty())
+        {
+            result = KernelSha1::local().hash(m_ranges);
+            if (result.isEmpty())
+            {
+                QByteArray data = KernelSha1::read(m_ranges);
+                if (!data.isEmpty())
+                    result = QCryptographicHash::hash(data, QCryptographicHash::Sha1);
+            }
+        }
+        else if (!m_zerohash.isEmpty() && m_data.size() == m_zerosize && isZero(m_data))
+            result = m_zerohash;
+        else
+            result = QCryptographicHash::hash(m_data, QCryptographicHash::Sha1);
         m_data.clear();
+        if (trace)
+            trace->add("hash", "hash", begin, trace->now(), piece);
+        finished.store(true, std::memory_order_release);
     }
+
+    //! True if data contains only zeros. Compares the data against itself shifted by one byte, which lets libc's vectorized memcmp do the work.
+    static bool isZero(const QByteArray& data)
+    {
+        return data.isEmpty() || (data.at(0) == 0 && !memcmp(data.constData(), data.constData() +1, data.size() -1));
+    }
+
+private:
+    QByteArray m_zerohash;
+    qint64 m_zerosize;
+    QList<KernelSha1::Range> m_ranges;
 };
 
 
-//! Creates the piece variable for given filelist. FileIO is done in the current thread while hashing is done in a threadpool. @warning Does block and shouldn't be used in the main thread.
+//! Creates the piece variable for given filelist. FileIO is done in the current thread while hashing is done in a threadpool. A file named "-" is read from stdin until the stream ends, its length is reported with streamEnded(), the same goes for a followed file. @sa setFollow() @warning Does block and shouldn't be used in the main thread.
 class TorrentFileHasher : public QObject
 {
     Q_OBJECT
@@ -39,84 +190,580 @@ public:
         m_piecesize(piecesize),
         m_contentlength(contentlength) {}
 
+    //! Periodically appends the finished piece hashes to filename, together with a fingerprint of the file list (paths, sizes, mtimes) and piece length. With resume a checkpoint matching the fingerprint is continued after its last piece. The checkpoint is removed once hashing succeeded.
+    void setCheckpoint(const QString& filename, bool resume) {m_checkpoint = filename; m_resume = resume;}
+
+    //! Additionally calculates a checksum of every file from the same read buffers, emitted with fileDigests() before done(). Disables resuming, a file's checksum needs all of its data.
+    void setFileDigest(QCryptographicHash::Algorithm algorithm) {m_digest = true; m_digestalgorithm = algorithm;}
+    ~TorrentFileHasher();
+
+    //! Reads the pieces sorted by their physical location on disk (FIEMAP) instead of in torrent order, which avoids seek storms on fragmented / rotational storage. Pieces are hashed out of order into their slot. Ignored for streams and together with setFileDigest(), both need the data in order. Files on several devices are always read with one reader per device.
+    void setPhysicalOrder(bool physical) {m_physical = physical;}
+    //! Hashes several torrents in one pass: every file in firstfiles starts a new torrent, so the piece before it ends short. done() gets the pieces of all of them concatenated. Disables resuming and out of order reads.
+    void setSegments(const QList<int>& firstfiles) {m_segments = QSet<int>(firstfiles.constBegin(), firstfiles.constEnd());}
+    //! Hashes only the pieces from first up to (excluding) end, done() gets just those, nothing for an empty range. Used to split the hashing of one torrent over several processes. Disables resuming.
+    void setRange(qint64 first, qint64 end) {m_rangebegin = first; m_rangeend = end;}
+    //! Hashes with the kernel's SHA1 (AF_ALG) and lets the workers splice the file data into it, no piece data is read into user space then. Ignored if KernelSha1::available() is false, and like setPhysicalOrder() for streams and file checksums.
+    void setKernelHash(bool kernel) {m_kernel = kernel && KernelSha1::available();}
+    //! Number of hash workers, 0 uses one per core.
+    void setWorkerCount(int workers) {m_workers = workers;}
+    //! Number of readers per device. More than one lets storage with deep queues (SSD, NVMe, arrays) read in parallel, pieces are read out of order then like with setPhysicalOrder().
+    void setReaderCount(int readers) {m_readers = qMax(1, readers);}
+    //! Compares every full piece read against zeros and gives it the precomputed zero digest instead of hashing it. Pays off for allocated but zeroed space, holes are skipped without it.
+    void setZeroCheck(bool check) {m_zerocheck = check;}
+
+    //! Measures the SHA1 throughput of a single core in bytes per second by hashing for about 200 ms.
+    static double measureHashRate()
+    {
+        QByteArray data(4 *1024 *1024, 'x');
+        QElapsedTimer timer;
+        timer.start();
+        qint64 hashed = 0;
+        while (!hashed || timer.elapsed() < 200)
+        {
+            QCryptographicHash::hash(data, QCryptographicHash::Sha1);
+            hashed += data.size();
+        }
+        return hashed * 1e9 / qMax(qint64(1), timer.nsecsElapsed());
+    }
+
+    //! Measures how fast readers threads read the content in bytes per second. Up to budget bytes are read in 4 MiB blocks spread evenly over the content, their page cache is dropped first so cached data doesn't count. Different skew values read different blocks. @return 0 if nothing could be read.
+    double measureReadRate(int readers, qint64 budget, int skew = 0);
+
+    //! Follows a single growing file like a stream: full pieces are hashed as the file grows and reading ends once its writer closes it (inotify IN_CLOSE_WRITE) or endmarker exists. The length is reported with streamEnded(). @warning A file that isn't open for writing anymore when hashing starts needs the end marker to finish, and any writer closing the file ends the follow, not only the one producing it.
+    void setFollow(const QString& endmarker = QString()) {m_follow = true; m_endmarker = endmarker;}
+    //! Records per piece read / hash events, file open / close and waits and writes them to filename in Chrome trace format when hashing ends (also if it fails). @sa HashTrace
+    void setTrace(const QString& filename) {m_tracefile = filename; if (!m_trace) m_trace = new HashTrace;}
+
 private:
     QList<QPair<QString, qint64> > m_filehash;
     qint64 m_piecesize, m_contentlength;
-    bool m_stop = false;
-    QMutex m_mutex;
+    //! Read by every reader thread, set by abort().
+    std::atomic<bool> m_stop{false};
     QThreadPool m_pool;
+    //! One per worker, taken by startTask() and given back when the task has run.
+    QSemaphore m_taskslots;
     QList<HashTask *> m_hashtasks;
+    QByteArray m_zerohash;
+    QString m_checkpoint;
+    bool m_resume = false;
+    QFile m_checkpointfile;
+    int m_checkpointed = 0;
+    bool m_physical = false;
+    int m_workers = 0, m_readers = 1;
+    bool m_kernel = false;
+    bool m_zerocheck = false;
+    QSet<int> m_segments;
+    //! m_rangeend is -1 without a range, an empty range hashes nothing.
+    qint64 m_rangebegin = 0, m_rangeend = -1;
+    QString m_tracefile;
+    HashTrace* m_trace = 0;
+    bool m_follow = false, m_followdone = false;
+    QString m_endmarker;
+    int m_inotify = -1;
+    bool m_digest = false;
+    QCryptographicHash::Algorithm m_digestalgorithm = QCryptographicHash::Sha1;
+    //! Runs the per file checksums in read order next to the piece hashing, the semaphore limits the chunks in flight.
+    QThreadPool m_digestpool;
+    QSemaphore m_digestslots{8};
+    QList<QCryptographicHash *> m_filedigests;
+
+    void addFileData(int index, const QByteArray& data)
+    {
+        QCryptographicHash* h = m_digest && !data.isEmpty() ? m_filedigests.value(index) : 0;
+        if (!h)
+            return;
+        m_digestslots.acquire();
+        m_digestpool.start([this, h, data]() {h->addData(data); m_digestslots.release();});
+    }
+
+    void clearDigests()
+    {
+        for (auto i = m_filedigests.constBegin(); i != m_filedigests.constEnd(); ++i)
+            delete (*i);
+        m_filedigests.clear();
+    }
+
+    //! Small files opened ahead of the reader: (file index, fd).
+    QList<QPair<int, int> > m_prefetch;
+    int m_nextprefetch = 0;
+
+    //! Opens up to 32 of the small files following index and asks the kernel to read them in the background (posix_fadvise WILLNEED), so the reader doesn't wait for each open / first read of tiny files. Large files are left to the normal readahead.
+    void prefetch(int index);
+
+    //! Returns the prefetched fd of file index or -1. Ownership goes to the caller.
+    int takePrefetched(int index);
+
+    void clearPrefetch();
+
+    static QByteArray checkpointMagic() {return "STC checkpoint 1\n";}
+
+    QByteArray fingerprint()
+    {
+        QCryptographicHash h(QCryptographicHash::Sha1);
+        h.addData(QByteArray::number(m_piecesize));
+        for (auto i = m_filehash.constBegin(); i != m_filehash.constEnd(); ++i)
+        {
+            h.addData('\0' + (*i).first.toUtf8() + '\0' + QByteArray::number((*i).second));
+            if (!(*i).first.isEmpty())
+                h.addData(':' + QByteArray::number(QFileInfo((*i).first).lastModified().toMSecsSinceEpoch()));
+        }
+        return h.result();
+    }
+
+    //! Returns the piece hashes of a checkpoint written for the same fingerprint and leaves it open for appending.
+    QByteArray loadCheckpoint(const QByteArray& fp)
+    {
+        QFile f(m_checkpoint);
+        if (!f.open(QIODevice::ReadOnly))
+            return QByteArray();
+        QByteArray header = checkpointMagic() + fp;
+        if (f.read(header.length()) != header)
+        {
+            emit checkpointDiscarded();
+            return QByteArray();
+        }
+        QByteArray pieces = f.readAll();
+        f.close();
+        // a crash can leave a partly written hash at the end
+        pieces.truncate(pieces.length() / 20 * 20);
+        m_checkpointfile.setFileName(m_checkpoint);
+        if (!m_checkpointfile.open(QIODevice::ReadWrite) || !m_checkpointfile.resize(header.length() + pieces.length()) || !m_checkpointfile.seek(m_checkpointfile.size()))
+        {
+            m_checkpointfile.close();
+            return QByteArray();
+        }
+        return pieces;
+    }
+
+    //! Appends the hashes of all pieces finished in order since the last call.
+    void writeCheckpoint(const QByteArray& fp);
+
+    //! Digest of a full piece made of zeros, calculated on first use.
+    const QByteArray& zeroHash()
+    {
+        if (m_zerohash.isEmpty())
+            m_zerohash = QCryptographicHash::hash(QByteArray(m_piecesize, '\0'), QCryptographicHash::Sha1);
+        return m_zerohash;
+    }
+
+    //! Finds the next hole in fd at or after pos with SEEK_HOLE / SEEK_DATA. begin and end are set to size if there is none or the file system doesn't support it. The file offset is left at pos.
+    static void findHole(int fd, qint64 pos, qint64 size, qint64& begin, qint64& end);
+
+    //! Reads whole pieces with pread() for one reader thread. Files stay open from one piece to the next, up to 64 at a time.
+    class PieceReader
+    {
+    public:
+        explicit PieceReader(const TorrentFileHasher* hasher) : m_hasher(hasher) {}
+        ~PieceReader() {closeAll();}
+        PieceReader(const PieceReader&) = delete;
+        PieceReader& operator=(const PieceReader&) = delete;
+
+        //! Reads piece index from the file list, pieces spanning several files are stitched together. If hole is given a piece lying entirely inside a hole of a sparse file isn't read, *hole is set instead. @return an empty QByteArray if any of the files can't be read or has been changed.
+        QByteArray read(qint64 index, bool* hole = 0);
+
+        //! Lets the kernel read piece index ahead while the current one is handed to the hash pool.
+        void willNeed(qint64 index);
+
+    private:
+        //! An open file and the last hole found in it, from probed on.
+        struct OpenFile
+        {
+            int fd;
+            qint64 probed, holebegin, holeend;
+        };
+
+        //! Returns the open file of range r, opened and checked against its expected size on first use. 0 if it can't be opened or has been changed.
+        OpenFile* file(const KernelSha1::Range& r);
+
+        void closeAll();
+
+        const TorrentFileHasher* m_hasher;
+        QHash<QString, OpenFile> m_files;
+    };
+
+    //! The file ranges making up piece index. @sa PieceReader
+    QList<KernelSha1::Range> pieceRanges(qint64 index) const
+    {
+        qint64 begin = index * m_piecesize;
+        qint64 end = qMin(begin + m_piecesize, m_contentlength);
+        qint64 offset = 0;
+        QList<KernelSha1::Range> ranges;
+        for (auto i = m_filehash.constBegin(); i != m_filehash.constEnd() && offset < end; ++i)
+        {
+            qint64 fbegin = offset;
+            offset += (*i).second;
+            if (offset <= begin || !(*i).second)
+                continue;
+            ranges << KernelSha1::Range{(*i).first, qMax(begin, fbegin) - fbegin, qMin(end, offset) - qMax(begin, fbegin), (*i).first.isEmpty() ? -1 : (*i).second};
+        }
+        return ranges;
+    }
+
+    struct Extent
+    {
+        qint64 logical, physical, length;
+    };
+
+    //! Returns the extents of fd with known physical location, sorted by logical offset. Empty if the file system doesn't support FIEMAP.
+    static QList<Extent> fileExtents(int fd);
+
+    //! Where the first byte of a piece is stored. address is -1 if unknown or not looked up.
+    struct ReadPosition
+    {
+        quint64 device;
+        qint64 address, index;
+        bool operator<(const ReadPosition& o) const
+        {
+            if ((address < 0) != (o.address < 0))
+                return address >= 0;
+            if (address < 0 || device == o.device)
+                return address == o.address ? index < o.index : address < o.address;
+            return device < o.device;
+        }
+    };
+
+    //! Returns the path of the file on its backing file system. Union mounts like mergerfs report their own device for all files, the branch a file lives on is exposed in the user.mergerfs.fullpath attribute. Only FUSE mounts are asked, fuse caches that per device.
+    static QByteArray backingPath(const QByteArray& path, quint64 device, QHash<quint64, bool>& fuse);
+
+    //! Returns the backing device of all pieces from firstpiece on, one stat() per file (and a getxattr() on FUSE mounts). With physical they are sorted by their physical address (FIEMAP), pieces with unknown location last in torrent order, otherwise they stay in torrent order. @param devices is set to the number of different devices.
+    std::vector<ReadPosition> planReads(qint64 firstpiece, bool physical, int* devices = 0);
+
+    //! Reads the planned pieces with one reader per backing device (setReaderCount() per device), all readers feed the shared hash pool. Pieces are hashed into their slot (index - firstpiece) so the result stays in torrent order. Pieces starting in a padding file go to the first reader. @return false after an error was thrown.
+    bool hashPlanned(const std::vector<ReadPosition>& plan, qint64 firstpiece, const QByteArray& fp, QElapsedTimer& checkpointtimer, qint64& donesize, int& progress);
+
+    //! Starts h as soon as a worker is free, the reading thread sleeps until then. Only as many pieces as there are workers are in flight. Traced as "worker wait" on the reading thread.
+    void startTask(HashTask* h, qint64 piece)
+    {
+        qint64 begin = m_trace ? m_trace->now() : 0;
+        bool waited = !m_taskslots.tryAcquire();
+        if (waited)
+            m_taskslots.acquire();
+        if (m_trace)
+        {
+            h->trace = m_trace;
+            h->piece = piece;
+            h->queued = m_trace->now();
+            if (waited)
+                m_trace->add("worker wait", "wait", begin, h->queued, piece);
+        }
+        m_pool.start([this, h]() {h->run(); m_taskslots.release();});
+    }
+
+    //! Watches the followed file for writes and closes and the directory of the end marker for new entries.
+    void watchFollowed(const QString& filename);
+
+    //! Blocks until the followed file changed, sets m_followdone if its writer closed it or the end marker appeared. Wakes up every second to notice abort(), without inotify this is all it does.
+    void waitForGrowth();
+
+    //! Closes file i of the list, traced from opened on.
+    void closeFile(QFile& f, int i, qint64 opened)
+    {
+        bool traced = m_trace && f.isOpen();
+        f.close();
+        if (traced)
+            m_trace->add("file", "io", opened, m_trace->now(), -1, m_filehash.at(i).first);
+    }
+
+    //! @return false if a trace was requested but couldn't be written.
+    bool writeTrace()
+    {
+        return !m_trace || m_trace->write(m_tracefile);
+    }
 
     void throwerror(const QString& msg)
     {
         m_pool.waitForDone(30000);
+        m_digestpool.waitForDone();
+        clearDigests();
+        m_checkpointfile.close();
+        clearPrefetch();
         for (auto i = m_hashtasks.constBegin(); i != m_hashtasks.constEnd(); ++i)
             delete (*i);
         m_hashtasks.clear();
+        writeTrace();
         emit error(msg);
     }
 
+public:
+    //! Hashes only the pieces in indices instead of the whole content. Blocks like hash() does. @return the SHA1 of every requested piece in the same order, an empty QByteArray for pieces that couldn't be read.
+    QList<QByteArray> hashPieces(const QList<qint64>& indices)
+    {
+        int workers = m_workers > 0 ? m_workers : qMax(2, QThread::idealThreadCount());
+        m_pool.setMaxThreadCount(workers);
+        // sampled pieces are scattered over the content, every worker reads and hashes its share so the reads run in parallel too
+        std::vector<QByteArray> result(indices.size());
+        for (int w = 0; w < qMin(workers, int(indices.size())); ++w)
+        {
+            m_pool.start([&, w]()
+            {
+                PieceReader reader(this);
+                for (int k = w; k < indices.size(); k += workers)
+                {
+                    QByteArray ba = reader.read(indices.at(k));
+                    if (!ba.isEmpty())
+                        result[k] = QCryptographicHash::hash(ba, QCryptographicHash::Sha1);
+                }
+            });
+        }
+        m_pool.waitForDone();
+        return QList<QByteArray>(result.begin(), result.end());
+    }
+
 signals:
     void progressUpdate(int progress);
+    void streamEnded(qint64 length);
+    //! The per file checksums, empty for padding files. @sa setFileDigest()
+    void fileDigests(QByteArrayList digests);
+    //! The checkpoint belongs to other content or settings, hashing starts from the first piece. @sa setCheckpoint()
+    void checkpointDiscarded();
     void done(QByteArray pieces);
     void error(QString errormessage);
 
 public slots:
-    void abort() {m_mutex.lock(); m_stop = true; m_mutex.unlock();}
+    void abort() {m_stop = true;}
     void hash()
     {
         int progress = 0;
         qint64 donesize = 0;
-        m_pool.setMaxThreadCount(qMax(2, QThread::idealThreadCount()));
+        m_pool.setMaxThreadCount(m_workers > 0 ? m_workers : qMax(2, QThread::idealThreadCount()));
+        m_taskslots.release(m_pool.maxThreadCount());
         QFile f;
         QByteArray ba, result;
+        qint64 holebegin = 0, holeend = 0, padleft = 0, streamlength = 0;
+        bool stream = false;
         int i = -1;
-        while (!m_stop)
+        qint64 opened = 0, readbegin = 0;
+        if (m_trace)
+            m_trace->nameThread("reader");
+
+        // a stream can't be read again, there is nothing to resume
+        if (m_follow || !m_segments.isEmpty())
+            m_checkpoint.clear();
+        for (auto x = m_filehash.constBegin(); x != m_filehash.constEnd(); ++x)
+            if ((*x).first == "-")
+                m_checkpoint.clear();
+        QByteArray fp;
+        QElapsedTimer checkpointtimer;
+        qint64 startoffset = 0;
+        if (m_digest)
+        {
+            m_resume = false;
+            m_digestpool.setMaxThreadCount(1);
+            clearDigests();
+            for (auto x = m_filehash.constBegin(); x != m_filehash.constEnd(); ++x)
+                m_filedigests << ((*x).first.isEmpty() ? 0 : new QCryptographicHash(m_digestalgorithm));
+        }
+        // a range starts at its first piece, a resumed run behind the checkpointed pieces
+        if (m_rangeend >= 0)
+            m_checkpoint.clear();
+        if (!m_checkpoint.isEmpty())
+        {
+            fp = fingerprint();
+            checkpointtimer.start();
+            if (m_resume)
+                result = loadCheckpoint(fp);
+        }
+        qint64 firstpiece = m_rangeend >= 0 ? m_rangebegin : result.length() / 20;
+        if (firstpiece)
+        {
+            // skip the files before firstpiece, startoffset is the position in the first file not fully skipped
+            qint64 skip = qMin(firstpiece * m_piecesize, m_contentlength);
+            qint64 offset = 0;
+            while (skip && i +1 < m_filehash.size() && offset + m_filehash.at(i +1).second <= skip)
+                offset += m_filehash.at(++i).second;
+            startoffset = skip - offset;
+            donesize = skip;
+        }
+
+        // read out of order when the data is laid out physically, spread over several devices, several readers share a device or the workers read themselves
+        bool planned = !m_digest && !m_follow && m_segments.isEmpty() && m_contentlength > 0;
+        for (auto x = m_filehash.constBegin(); x != m_filehash.constEnd(); ++x)
+            if ((*x).first == "-")
+                planned = false;
+        if (planned)
         {
-            if (!f.isOpen())
+            int devices = 0;
+            std::vector<ReadPosition> plan = planReads(firstpiece, m_physical, &devices);
+            planned = m_physical || devices > 1 || m_readers > 1 || m_kernel;
+            if (planned && !hashPlanned(plan, firstpiece, fp, checkpointtimer, donesize, progress))
+                return;
+        }
+
+        while (!m_stop && !planned)
+        {
+            if (m_rangeend >= 0 && firstpiece + m_hashtasks.size() >= m_rangeend)
+                break;
+            if (!m_checkpoint.isEmpty() && checkpointtimer.elapsed() > 30000)
+            {
+                writeCheckpoint(fp);
+                checkpointtimer.restart();
+            }
+
+            if (!f.isOpen() && !padleft)
             {
                 ++i;
                 if (i == m_filehash.size())
                     break;
-                f.setFileName(m_filehash.at(i).first);
-                if (!f.open(QIODevice::ReadOnly | QIODevice::Unbuffered))
+                if (m_segments.contains(i) && !ba.isEmpty())
                 {
-                    throwerror("Can't open file: " + m_filehash.at(i).first);
-                    return;
+                    // the next torrent starts with this file, the last piece of the previous one is short
+                    HashTask* h = new HashTask(ba);
+                    m_hashtasks << h;
+                    ba.clear();
+                    startTask(h, firstpiece + m_hashtasks.size() -1);
                 }
-                if (f.size() != m_filehash.at(i).second)
+                opened = m_trace ? m_trace->now() : 0;
+                if (m_filehash.at(i).first.isEmpty())
                 {
-                    f.close();
-                    throwerror("File \"" + m_filehash.at(i).first + "\"has been changed, operation aborted!");
-                    return;
+                    // BEP 47 padding file, zeros that don't exist on disk
+                    padleft = m_filehash.at(i).second - startoffset;
+                    startoffset = 0;
+                    if (!padleft)
+                        continue;
+                }
+                else if (m_filehash.at(i).first == "-")
+                {
+                    stream = true;
+                    if (!f.open(STDIN_FILENO, QIODevice::ReadOnly | QIODevice::Unbuffered))
+                    {
+                        throwerror("Can't read from stdin");
+                        return;
+                    }
+                }
+                else if (m_follow)
+                {
+                    stream = true;
+                    // watch before the first read, a close in between would be missed otherwise
+                    watchFollowed(m_filehash.at(i).first);
+                    f.setFileName(m_filehash.at(i).first);
+                    if (!f.open(QIODevice::ReadOnly | QIODevice::Unbuffered))
+                    {
+                        throwerror("Can't open file: " + m_filehash.at(i).first);
+                        return;
+                    }
+                }
+                else
+                {
+                    stream = false;
+                    int fd = takePrefetched(i);
+                    prefetch(i);
+                    f.setFileName(m_filehash.at(i).first);
+                    if (fd >= 0 ? !f.open(fd, QIODevice::ReadOnly | QIODevice::Unbuffered, QFileDevice::AutoCloseHandle) : !f.open(QIODevice::ReadOnly | QIODevice::Unbuffered))
+                    {
+                        throwerror("Can't open file: " + m_filehash.at(i).first);
+                        return;
+                    }
+                    if (m_trace)
+                        m_trace->add("open", "io", opened, m_trace->now(), -1, m_filehash.at(i).first);
+                    if (f.size() != m_filehash.at(i).second)
+                    {
+                        f.close();
+                        throwerror("File \"" + m_filehash.at(i).first + "\"has been changed, operation aborted!");
+                        return;
+                    }
+                    // a file smaller than a piece can't hold a piece sized hole
+                    holebegin = holeend = m_filehash.at(i).second;
+                    if (m_filehash.at(i).second >= m_piecesize)
+                        findHole(f.handle(), 0, m_filehash.at(i).second, holebegin, holeend);
+                    if (startoffset)
+                        f.seek(startoffset);
+                    startoffset = 0;
+                }
+            }
+
+            bool hole = false, eof = false;
+            if (padleft)
+            {
+                qint64 n = qMin(padleft, m_piecesize - ba.length());
+                ba += QByteArray(n, '\0');
+                padleft -= n;
+            }
+            else if (stream)
+            {
+                // pipes return short reads, only an empty read is the end of the stream
+                readbegin = m_trace ? m_trace->now() : 0;
+                QByteArray chunk = f.read(m_piecesize - ba.length());
+                // a followed file ends when its writer is done, the read after that picks up the last data
+                while (chunk.isEmpty() && m_follow && !m_followdone && !m_stop)
+                {
+                    waitForGrowth();
+                    chunk = f.read(m_piecesize - ba.length());
+                }
+                if (m_trace)
+                    m_trace->add("read", "io", readbegin, m_trace->now(), firstpiece + m_hashtasks.size());
+                eof = chunk.isEmpty();
+                streamlength += chunk.length();
+                addFileData(i, chunk);
+                ba += chunk;
+            }
+            else
+            {
+                // pieces lying entirely inside a hole of a sparse file are neither read nor hashed
+                qint64 pos = f.pos();
+                if (ba.isEmpty() && holeend < m_filehash.at(i).second && pos >= holeend)
+                    findHole(f.handle(), pos, m_filehash.at(i).second, holebegin, holeend);
+                hole = ba.isEmpty() && pos >= holebegin && pos + m_piecesize <= holeend;
+                if (hole)
+                {
+                    f.seek(pos + m_piecesize);
+                    if (m_digest)
+                        addFileData(i, QByteArray(m_piecesize, '\0'));
+                }
+                else
+                {
+                    readbegin = m_trace ? m_trace->now() : 0;
+                    QByteArray chunk = f.read(m_piecesize - ba.length());
+                    if (m_trace)
+                        m_trace->add("read", "io", readbegin, m_trace->now(), firstpiece + m_hashtasks.size(), m_filehash.at(i).first);
+                    addFileData(i, chunk);
+                    ba += chunk;
                 }
             }
-            ba += f.read(m_piecesize - ba.length());
-            if (ba.length() == m_piecesize)
+
+            if (hole || ba.length() == m_piecesize)
             {
-                HashTask* h = new HashTask(ba);
+                HashTask* h = new HashTask(ba, m_zerocheck ? zeroHash() : QByteArray(), m_piecesize);
                 m_hashtasks << h;
+                if (hole)
+                {
+                    h->result = zeroHash();
+                    h->finished = true;
+                }
                 ba.clear();
                 donesize += m_piecesize;
-                int pg = (double)donesize / (double)m_contentlength *100;
+                int pg = m_contentlength > 0 ? (double)donesize / (double)m_contentlength *100 : 0;
                 if (pg != progress)
                 {
                     progress = pg;
                     emit progressUpdate(progress);
                 }
 
-                while (!m_pool.tryStart(h)) {}
+                if (!hole)
+                    startTask(h, firstpiece + m_hashtasks.size() -1);
             }
-            else
-                f.close();
+            else if (!stream || eof)
+                closeFile(f, i, opened);
+            // close fully read files right away instead of issuing another read() just to see EOF
+            if (f.isOpen() && !stream && f.pos() >= m_filehash.at(i).second)
+                closeFile(f, i, opened);
         }
 
         m_pool.waitForDone();
+        m_digestpool.waitForDone();
         if (f.isOpen())
             f.close();
+        clearPrefetch();
 
         if (!m_stop)
         {
+            // only tasks hashing file ranges themselves can fail
+            for (auto i = m_hashtasks.constBegin(); i != m_hashtasks.constEnd(); ++i)
+                if ((*i)->result.size() != 20)
+                {
+                    throwerror("Can't read piece " + QString::number(firstpiece + (i - m_hashtasks.constBegin())) + ", files have been changed or removed. Operation aborted!");
+                    return;
+                }
             for (auto i = m_hashtasks.constBegin(); i != m_hashtasks.constEnd(); ++i)
             {
                 result += (*i)->result;
@@ -125,11 +772,31 @@ public slots:
             if (!ba.isEmpty())
                 result += QCryptographicHash::hash(ba, QCryptographicHash::Sha1);
             if (progress != 100) progressUpdate(100);
+            if (stream)
+                emit streamEnded(streamlength);
+            if (m_digest)
+            {
+                QByteArrayList digests;
+                for (auto x = m_filedigests.constBegin(); x != m_filedigests.constEnd(); ++x)
+                    digests << ((*x) ? (*x)->result() : QByteArray());
+                emit fileDigests(digests);
+            }
+            if (m_checkpointfile.isOpen())
+                m_checkpointfile.remove();
 
-            emit done(result);
+            // the trace is complete before done() lets the caller exit
+            if (!writeTrace())
+                emit error("Could not write trace to file: " + m_tracefile);
+            else
+                emit done(result);
         }
         else
         {
+            // all tasks are done now, keep everything for a later resume
+            if (!m_checkpoint.isEmpty())
+                writeCheckpoint(fp);
+            m_checkpointfile.close();
+            writeTrace();
             for (auto i = m_hashtasks.constBegin(); i != m_hashtasks.constEnd(); ++i)
                 delete (*i);
             m_hashtasks.clear();
@@ -159,8 +826,8 @@ public:
     //! Opens and parses keys specified by keytype of the given file.
     Q_INVOKABLE bool load(const QString& filename, TorrentFile::DATATYPE keytype = ADDITIONAL);
 
-    //! Creates a torrentfile from the data. The hashing is done in a seperate thread. @sa TorrentFileHashCreator, progress(), finished() @return false if there is data missing, otherwise true.
-    Q_INVOKABLE bool create(const QString& filename);
+    //! Creates a torrentfile from the data. The hashing is done in a seperate thread. Progress is checkpointed to filename + ".stcresume" until the torrent is written. @param resume continues from that checkpoint if it was made for the same files and piece length. @sa TorrentFileHashCreator, progress(), finished() @return false if there is data missing, otherwise true.
+    Q_INVOKABLE bool create(const QString& filename, bool resume = false);
 
     //! Returns the size the resulting torrent file will be in bytes.
     Q_INVOKABLE qint64 calculateTorrentfileSize();
@@ -174,8 +841,13 @@ public:
     //! Sets the file for single file torrents.
     Q_INVOKABLE void setFile(const QString& filename);
 
-    //! Sets the directory for multi-file torrents.
-    Q_INVOKABLE void setDirectory(const QString& path);
+    //! Sets up a single file torrent named name whose content is read from stdin when hashing. The length is set once the stream ends, so the piece length must be set beforehand.
+    Q_INVOKABLE void setStream(const QString& name);
+    //! Like setFile() for a file that is still being written. The length is set once create() has read it to the end. @sa TorrentFileHasher::setFollow()
+    Q_INVOKABLE void setFollow(const QString& filename, const QString& endmarker = QString());
+
+    //! Sets the directory for multi-file torrents. @param padded inserts BEP 47 padding files (attr "p") so every file starts at a piece boundary. The padding follows later piece length changes. See http://bittorrent.org/beps/bep_0047.html
+    Q_INVOKABLE void setDirectory(const QString& path, bool padded = false);
 
     //! Sets the directory where the files specified in the metainfo are in. This is needed to find the files when creating a torrent file.
     Q_INVOKABLE void setRootDirectory(const QString& path);
@@ -183,8 +855,20 @@ public:
     //! Aborts a running hash thread if there is any.
     Q_INVOKABLE void abortHashing();
 
+    //! Outcome of verify() for one file.
+    struct VerifyResult
+    {
+        QString path;
+        //! Sampled pieces touching the file and how many of them didn't match.
+        qint64 checked = 0, failed = 0;
+    };
+    //! Spot checks the data by hashing a sample of pieces against the loaded piece hashes. The content is split into count equal ranges with one piece picked per range, every file no picked piece touches gets one piece of its own. The picks only depend on seed, so a run can be repeated exactly. Blocks, call after load() and setRootDirectory(). @param count all pieces if <= 0 or more than there are. @return one entry per file (padding files excluded) in torrent order, empty if the piece data doesn't fit the file list.
+    QList<VerifyResult> verify(qint64 count, quint32 seed = 0);
+
     //! Creates bencoding of the given data. @param createinfohash true creates and sets the info hash.
-    QByteArray encode(const QVariant& data, const bool createinfohash = false);
+    QByteArray encode(const QVariant& data, const bool createinfohash = false) {return encodeBencode(data, createinfohash ? &m_infohash : 0);}
+    //! Creates bencoding of the given data without a TorrentFile instance. @param infohash if set receives the hash of any "info" dictionary encoded.
+    static QByteArray encodeBencode(const QVariant& data, QByteArray* infohash = 0);
 
 
     Q_INVOKABLE QString getName() const {return m_data.value("info").toMap().value("name").toString();}
@@ -225,8 +909,50 @@ public:
     Q_INVOKABLE void addInfoData(const QString& key, const QVariant& value) {if (!standardkeys.contains(key)) { QVariantMap m = m_data.value("info").toMap(); m.insert(key, value); m_data.insert("info", m); }}
     //! Sets the piece length to the smallest size that doesn't exceed maxpiecenumber or maxpiecesize. @returns piece length.
     Q_INVOKABLE qint64 setAutomaticPieceLength();
+
+    //! Splits the files set with setDirectory() into consecutive groups of at most maxsize bytes, create() then writes one torrent per group from a single hashing pass. All parts keep the name, so they seed from the same directory. A file larger than maxsize gets a group of its own. Not for padded torrents. @return the number of groups.
+    Q_INVOKABLE int setSplit(qint64 maxsize);
+    //! Index of the first file and the content size of every group. @sa setSplit()
+    QList<QPair<int, qint64> > splitGroups() const {return m_split;}
+    //! The file a split create() writes group to for the torrent filename, <name>.partN.torrent with N counting from 1.
+    static QString splitFileName(const QString& filename, int group);
+    //! The files written by a split create() with their hex info hashes.
+    QList<QPair<QString, QByteArray> > splitResults() const {return m_splitresults;}
+
+    //! Lets create() hash only shard index (0 based) of count piece aligned ranges and write them to a partial file instead of the torrent. @sa merge()
+    Q_INVOKABLE void setShard(int index, int count) {m_shard = index; m_shards = count;}
+    //! Assembles the partial files written by sharded create() runs into the pieces and writes the torrent to filename like create() does, finished() is emitted from the event loop. The files and all settings must be the same as for the shards. @return false with an error emitted if a shard is missing, doesn't belong to this torrent or the target can't be written.
+    Q_INVOKABLE bool merge(const QString& filename, const QStringList& shards);
+
+    //! Result of plan(). Rates are in bytes per second, duration in milliseconds.
+    struct Plan
+    {
+        qint64 piecelength = 0;
+        int readers = 1, workers = 1;
+        double readrate = 0, hashrate = 0;
+        //! SHA1 rate through AF_ALG, 0 if not available. kernelsha1 is set if setKernelHash() was requested and AF_ALG is available, hashrate is the kernel's then.
+        double kernelrate = 0;
+        bool kernelsha1 = false;
+        qint64 duration = 0, metainfosize = 0;
+    };
+    //! Plans create() for the current files. The piece length comes closest to piececount (or the automatic one without) and is doubled until the metainfo fits maxsize. A short calibration on the files measures the read rate with one and four readers and the SHA1 rate of one core (built-in and kernel AF_ALG, the kernel one is used if setKernelHash() was requested), the faster reader count is kept and as many workers as are needed to keep up with it. The piece length and concurrency are applied to this object. @param maxsize limit of the metainfo size in bytes, 0 for none. @param piececount preferred number of pieces, 0 for none. @param choosepiecelength false keeps the current piece length.
+    Plan plan(qint64 maxsize = 0, qint64 piececount = 0, bool choosepiecelength = true);
     //! Adds current secs since epoch to the info section to alter info hash.
     void dupe();
+    //! Calculates a checksum of every file while hashing. "sha1" and "md5" are stored in the metainfo (BEP 47 "sha1" / "md5sum" keys), "sha256" can only go to a checksum file. Call after setFile() / setDirectory(), placeholders are inserted right away so calculateTorrentfileSize() stays exact. @param sidecar if not empty a sha1sum / md5sum / sha256sum compatible file is written there as well. @return false for an unknown type.
+    Q_INVOKABLE bool setFileChecksum(const QString& type, const QString& sidecar = QString());
+    //! Lets create() read the pieces in the order they are laid out on disk. @sa TorrentFileHasher::setPhysicalOrder()
+    Q_INVOKABLE void setPhysicalOrder(bool physical) {m_physical = physical;}
+    //! Lets create() hash through the kernel (AF_ALG) if available. @sa TorrentFileHasher::setKernelHash()
+    Q_INVOKABLE void setKernelHash(bool kernel) {m_kernel = kernel;}
+    //! Lets create() skip hashing pieces that read as all zeros. @sa TorrentFileHasher::setZeroCheck()
+    Q_INVOKABLE void setZeroCheck(bool check) {m_zerocheck = check;}
+    //! Lets create() record a per piece trace of the hashing to filename. @sa TorrentFileHasher::setTrace()
+    Q_INVOKABLE void setTrace(const QString& filename) {m_tracefile = filename;}
+    //! Lets create() write client resume data next to the torrent, so the client can seed without rechecking. The modification times are taken before hashing, nothing is written if a file changed meanwhile. @param fastresume libtorrent .fastresume file. @param rtorrent copy of the torrent with the libtorrent_resume and rtorrent keys rTorrent reads on load.
+    Q_INVOKABLE void setResumeData(const QString& fastresume, const QString& rtorrent = QString()) {m_fastresume = fastresume; m_rtorrentresume = rtorrent;}
+    //! Returns all files below path with their sizes, sorted by name with subdirectories first. Symlinked files are skipped, symlinked directories are followed unless they lead back to a directory above them.
+    static QList<QPair<QString, qint64> > getFilesFromFolder(QString path, QStringList parents = QStringList());
 
 
 private:
@@ -235,18 +961,43 @@ private:
     QString m_realname, m_parentdir;
     QThread* m_hashthread = 0;
     TorrentFileHasher* m_hasher = 0;
+    //! The files to hash, padding files have an empty path.
     QList<QPair<QString, qint64> > m_filelist;
+    bool m_padded = false;
+    bool m_physical = false;
+    int m_readers = 1, m_workers = 0;
+    bool m_kernel = false;
+    bool m_zerocheck = false;
+    QList<QPair<int, qint64> > m_split;
+    int m_shard = 0, m_shards = 0;
+    QList<QPair<QString, QByteArray> > m_splitresults;
+    QString m_checksum, m_checksumfile;
+    QString m_fastresume, m_rtorrentresume;
+    QString m_tracefile;
+    bool m_follow = false;
+    QString m_endmarker;
+    //! Modification times of m_filelist taken by create(), 0 for padding files.
+    QList<qint64> m_mtimes;
     QFileSystemWatcher m_watcher;
     QFile m_outputfile;
 
 
     QVariant decodeBencode(const QByteArray& bencode, DATATYPE keytype = ADDITIONAL, qint64 *parsedLength = 0);
     void resetFiles();
-    QList<QPair<QString, qint64> > getFilesFromFolder(QString path);
+    //! Rebuilds the padding files for the current piece length if setDirectory() was called with padded.
+    void updatePadding();
+    //! Writes the resume data requested with setResumeData() for the finished torrent. @return an error message or an empty string.
+    QString writeResumeData();
+    //! Identifies the torrent a shard belongs to: the SHA1 of the bencoded info dictionary without the pieces.
+    QByteArray shardFingerprint() const;
+    //! Writes one torrent per split group next to m_outputfile as <name>.partN.torrent. @return an error message or an empty string.
+    QString writeSplit(const QByteArray& pieces);
 
 signals:
     //! Emitted on progress updates after create() was invoked.
     void progress(int percentage);
+    //! Emitted when the checkpoint to resume from doesn't match the content and the hashing starts over. @sa create()
+    void checkpointDiscarded();
     //! Emitted after a torrent file is finished. @sa create()
     void finished(bool success);
     //! Emitted when a directory used to create this torrent had files added / removed.
@@ -256,6 +1007,8 @@ signals:
 
 private slots:
     void onWatchedDirChanged(const QString& dir);
+    void onStreamEnded(qint64 length);
+    void onFileDigests(QByteArrayList digests);
 
 public slots:
     void onThreadFinished(QByteArray pieces);
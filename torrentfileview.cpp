@@ -0,0 +1,592 @@
+#include "torrentfileview.h"
+#include "torrentfile.h"
+
+#include <QSaveFile>
+#include <cstring>
+
+bool TorrentFileView::open(const QString &filename)
+{
+    close();
+
+    m_file.setFileName(filename);
+    if (!m_file.open(QIODevice::ReadOnly) || m_file.size() < 2)
+    {
+        close();
+        return false;
+    }
+    m_size = m_file.size();
+    m_bytes = reinterpret_cast<const char*>(m_file.map(0, m_size));
+    if (!m_bytes)
+    {
+        // mapping is not supported everywhere (e.g. some pipes / special files)
+        m_buffer = m_file.readAll();
+        m_bytes = m_buffer.constData();
+        m_size = m_buffer.size();
+    }
+    if (!index())
+    {
+        close();
+        return false;
+    }
+    return true;
+}
+
+bool TorrentFileView::openData(const QByteArray &data)
+{
+    close();
+
+    m_buffer = data;
+    m_bytes = m_buffer.constData();
+    m_size = m_buffer.size();
+    if (!index())
+    {
+        close();
+        return false;
+    }
+    return true;
+}
+
+void TorrentFileView::close()
+{
+    if (m_file.isOpen())
+        m_file.close(); // also unmaps
+    m_buffer.clear();
+    m_bytes = 0;
+    m_size = 0;
+    m_infospan = Span();
+    m_entries.clear();
+    m_infoentries.clear();
+    m_infohash.clear();
+}
+
+QVariant TorrentFileView::value(const QString &key, const QVariant &defaultvalue) const
+{
+    Span s = span(key);
+    qint64 end = 0;
+    return s.isValid() ? decodeValue(s.begin, &end, key.toUtf8()) : defaultvalue;
+}
+
+QVariant TorrentFileView::infoValue(const QString &key, const QVariant &defaultvalue) const
+{
+    Span s = infoSpan(key);
+    qint64 end = 0;
+    return s.isValid() ? decodeValue(s.begin, &end, key.toUtf8()) : defaultvalue;
+}
+
+QVariant TorrentFileView::decode(const Span &s) const
+{
+    if (!s.isValid())
+        return QVariant();
+    qint64 end = 0;
+    return decodeValue(s.begin, &end, QByteArray());
+}
+
+QByteArray TorrentFileView::getInfoHash(bool hex) const
+{
+    if (m_infohash.isEmpty() && m_infospan.isValid())
+        m_infohash = QCryptographicHash::hash(raw(m_infospan), QCryptographicHash::Sha1);
+    return hex ? m_infohash.toHex() : m_infohash;
+}
+
+QStringList TorrentFileView::getAnnounceUrls() const
+{
+    QVariantList vl = value("announce-list").toList();
+    QStringList l;
+    QString a = value("announce").toString();
+    if (!a.isEmpty())
+        l << a;
+    for (auto i = vl.constBegin(); i != vl.constEnd(); ++i)
+        l << (*i).toStringList();
+    l.removeDuplicates();
+    return l;
+}
+
+qint64 TorrentFileView::getContentLength() const
+{
+    qint64 ret = 0;
+    FileIterator it = files();
+    while (it.hasNext())
+        ret += it.next().second;
+    return ret;
+}
+
+TorrentFileView::FileIterator TorrentFileView::files() const
+{
+    FileIterator it;
+    it.m_view = this;
+    Span s = infoSpan("files");
+    if (s.isValid() && m_bytes[s.begin] == 'l')
+    {
+        it.m_pos = s.begin + 1;
+        it.m_end = s.end - 1;
+    }
+    else if (infoSpan("length").isValid())
+    {
+        // single file, the whole info dict acts as the only entry
+        it.m_pos = m_infospan.begin;
+        it.m_end = m_infospan.begin + 1;
+    }
+    return it;
+}
+
+QPair<QStringList, qint64> TorrentFileView::FileIterator::next()
+{
+    QPair<QStringList, qint64> ret(QStringList(), 0);
+    m_padding = false;
+    if (!hasNext())
+        return ret;
+
+    if (m_pos == m_view->m_infospan.begin)
+    {
+        ret.second = m_view->infoValue("length", 0).toLongLong();
+        m_pos = m_end;
+        return ret;
+    }
+
+    QList<Entry> entries;
+    qint64 end = -1;
+    if (!m_view->indexDictionary(m_pos, entries, &end))
+    {
+        m_pos = -1;
+        return ret;
+    }
+    Entry e = find(entries, "length");
+    if (e.value.isValid())
+        ret.second = m_view->decode(e.value).toLongLong();
+    e = find(entries, "path");
+    if (e.value.isValid())
+        ret.first = m_view->decode(e.value).toStringList();
+    e = find(entries, "attr");
+    if (e.value.isValid())
+        m_padding = m_view->decode(e.value).toString().contains('p');
+    m_pos = end;
+    return ret;
+}
+
+QByteArray TorrentFileView::splice(const QMap<QByteArray, QByteArray> &changes, const QMap<QByteArray, QByteArray> &infochanges, QByteArray *infohash) const
+{
+    QByteArray info = infochanges.isEmpty() ? raw(m_infospan) : spliceDictionary(m_infoentries, infochanges, m_infospan.size());
+    if (infohash)
+        *infohash = QCryptographicHash::hash(info, QCryptographicHash::Sha1);
+
+    QMap<QByteArray, QByteArray> c = changes;
+    c.insert("info", info);
+    return spliceDictionary(m_entries, c, m_size);
+}
+
+qint64 TorrentFileView::skip(qint64 pos, int depth) const
+{
+    if (pos < 0 || pos >= m_size || depth > maxDepth())
+        return -1;
+
+    char c = m_bytes[pos];
+    if (c == 'i')
+    {
+        const char* e = static_cast<const char*>(memchr(m_bytes + pos, 'e', m_size - pos));
+        return e ? e - m_bytes + 1 : -1;
+    }
+    if (c == 'l' || c == 'd')
+    {
+        ++pos;
+        while (pos < m_size && m_bytes[pos] != 'e')
+        {
+            pos = skip(pos, depth +1);
+            if (pos < 0)
+                return -1;
+        }
+        return pos < m_size ? pos + 1 : -1;
+    }
+    if (c >= '0' && c <= '9')
+    {
+        qint64 length = 0;
+        while (pos < m_size && m_bytes[pos] >= '0' && m_bytes[pos] <= '9')
+        {
+            length = length * 10 + (m_bytes[pos] - '0');
+            if (length > m_size)
+                return -1;
+            ++pos;
+        }
+        if (pos >= m_size || m_bytes[pos] != ':' || length > m_size - pos - 1)
+            return -1;
+        return pos + 1 + length;
+    }
+    return -1;
+}
+
+QByteArray TorrentFileView::stringData(const Span &s) const
+{
+    if (!s.isValid())
+        return QByteArray();
+    const char* colon = static_cast<const char*>(memchr(m_bytes + s.begin, ':', s.size()));
+    if (!colon)
+        return QByteArray();
+    qint64 begin = colon - m_bytes + 1;
+    return QByteArray::fromRawData(m_bytes + begin, s.end - begin);
+}
+
+bool TorrentFileView::index()
+{
+    if (!m_bytes || m_size < 2 || m_bytes[0] != 'd')
+        return false;
+
+    qint64 end = -1;
+    if (!indexDictionary(0, m_entries, &end))
+        return false;
+
+    m_infospan = find(m_entries, "info").value;
+    if (!m_infospan.isValid() || m_bytes[m_infospan.begin] != 'd')
+    {
+        m_infospan = Span();
+        return false;
+    }
+    return indexDictionary(m_infospan.begin, m_infoentries, &end);
+}
+
+bool TorrentFileView::indexDictionary(qint64 pos, QList<Entry> &entries, qint64 *end) const
+{
+    if (pos < 0 || pos >= m_size || m_bytes[pos] != 'd')
+        return false;
+
+    ++pos;
+    while (pos < m_size && m_bytes[pos] != 'e')
+    {
+        Entry e;
+        e.keyspan.begin = pos;
+        e.keyspan.end = skip(pos);
+        if (e.keyspan.end < 0 || m_bytes[pos] < '0' || m_bytes[pos] > '9')
+            return false;
+        e.key = stringData(e.keyspan);
+        e.key.detach();
+        e.value.begin = e.keyspan.end;
+        e.value.end = skip(e.value.begin);
+        if (e.value.end < 0)
+            return false;
+        entries.append(e);
+        pos = e.value.end;
+    }
+    if (pos >= m_size)
+        return false;
+    *end = pos + 1;
+    return true;
+}
+
+QByteArray TorrentFileView::spliceDictionary(const QList<Entry> &entries, const QMap<QByteArray, QByteArray> &changes, qint64 sizehint) const
+{
+    QByteArray ret;
+    qint64 reserve = sizehint;
+    for (auto c = changes.constBegin(); c != changes.constEnd(); ++c)
+        reserve += c.key().size() + c.value().size() + 22;
+    ret.reserve(reserve);
+
+    ret += 'd';
+    auto c = changes.constBegin();
+    for (auto i = entries.constBegin(); i != entries.constEnd(); ++i)
+    {
+        while (c != changes.constEnd() && c.key() < (*i).key)
+        {
+            if (!c.value().isEmpty())
+                ret += QByteArray::number(c.key().size()) + ':' + c.key() + c.value();
+            ++c;
+        }
+        if (c != changes.constEnd() && c.key() == (*i).key)
+        {
+            if (!c.value().isEmpty())
+                ret += raw((*i).keyspan) + c.value();
+            ++c;
+        }
+        else
+            ret += raw(Span{(*i).keyspan.begin, (*i).value.end});
+    }
+    for (; c != changes.constEnd(); ++c)
+        if (!c.value().isEmpty())
+            ret += QByteArray::number(c.key().size()) + ':' + c.key() + c.value();
+    ret += 'e';
+    return ret;
+}
+
+QVariant TorrentFileView::decodeValue(qint64 pos, qint64 *end, const QByteArray &key) const
+{
+    *end = skip(pos);
+    if (*end < 0)
+        return QVariant();
+
+    char c = m_bytes[pos];
+    if (c == 'i')
+        return QByteArray::fromRawData(m_bytes + pos + 1, *end - pos - 2).toLongLong();
+
+    if (c >= '0' && c <= '9')
+    {
+        Span s{pos, *end};
+        // assume string, unless we know it's bytes
+        if (key == "pieces" || key == "pieces root" || key == "sha1")
+        {
+            QByteArray ba = stringData(s);
+            ba.detach();
+            return ba;
+        }
+        return QString(stringData(s));
+    }
+
+    qint64 p = pos + 1;
+    qint64 e = 0;
+    if (c == 'l')
+    {
+        QVariantList l;
+        while (m_bytes[p] != 'e')
+        {
+            l.append(decodeValue(p, &e, QByteArray()));
+            p = e;
+        }
+        return l;
+    }
+
+    QVariantMap m;
+    while (m_bytes[p] != 'e')
+    {
+        qint64 keyend = skip(p);
+        QByteArray k = stringData(Span{p, keyend});
+        m.insert(QString(k), decodeValue(keyend, &e, k));
+        p = e;
+    }
+    return m;
+}
+
+void TorrentFileView::writeJson(QTextStream &out, const QStringList &fields) const
+{
+    if (!isValid())
+        return;
+    if (fields.isEmpty())
+    {
+        writeJsonValue(out, 0, QByteArray(), 0);
+        out << "\n";
+        return;
+    }
+
+    bool first = true;
+    out << "{";
+    for (auto i = fields.constBegin(); i != fields.constEnd(); ++i)
+    {
+        QString name = (*i).section("[].", 0, 0);
+        QByteArrayList only;
+        if ((*i).contains("[]."))
+            only << (*i).section("[].", 1).toUtf8();
+
+        Span s;
+        if (name == "infohash")
+            s.begin = 0;
+        else if (name.startsWith("info."))
+            s = infoSpan(name.mid(5));
+        else
+            s = span(name).isValid() ? span(name) : infoSpan(name);
+        if (!s.isValid())
+            continue;
+
+        out << (first ? "\n" : ",\n") << "    ";
+        first = false;
+        writeJsonString(out, name);
+        out << ": ";
+        if (name == "infohash")
+            out << "\"" << getInfoHash(true) << "\"";
+        else
+            writeJsonValue(out, s.begin, name.section('.', -1).toUtf8(), 1, only);
+    }
+    out << (first ? "}\n" : "\n}\n");
+}
+
+void TorrentFileView::writeJsonValue(QTextStream &out, qint64 pos, const QByteArray &key, int indent, const QByteArrayList &only) const
+{
+    qint64 end = skip(pos);
+    if (end < 0)
+    {
+        out << "null";
+        return;
+    }
+
+    char c = m_bytes[pos];
+    if (c == 'i')
+    {
+        out << QString::fromLatin1(m_bytes + pos + 1, end - pos - 2);
+        return;
+    }
+    if (c >= '0' && c <= '9')
+    {
+        QByteArray ba = stringData(Span{pos, end});
+        if (key == "pieces")
+            out << "\"<stripped>\"";
+        else if (key == "sha1" || key == "pieces root")
+            out << "\"" << ba.toHex() << "\"";
+        else
+            writeJsonString(out, QString::fromUtf8(ba));
+        return;
+    }
+
+    QByteArray spaces((indent +1) * 4, ' ');
+    bool first = true;
+    qint64 p = pos + 1;
+    out << (c == 'l' ? "[" : "{");
+    while (p < end - 1)
+    {
+        qint64 next = skip(p);
+        if (c == 'l')
+        {
+            out << (first ? "\n" : ",\n") << spaces;
+            writeJsonValue(out, p, QByteArray(), indent +1, only);
+        }
+        else
+        {
+            QByteArray k = stringData(Span{p, next});
+            qint64 valueend = skip(next);
+            if (only.isEmpty() || only.contains(k))
+            {
+                out << (first ? "\n" : ",\n") << spaces;
+                writeJsonString(out, QString::fromUtf8(k));
+                out << ": ";
+                writeJsonValue(out, next, k, indent +1);
+            }
+            else
+            {
+                p = valueend;
+                continue;
+            }
+            next = valueend;
+        }
+        first = false;
+        p = next;
+    }
+    if (!first)
+        out << "\n" << QByteArray(indent * 4, ' ');
+    out << (c == 'l' ? "]" : "}");
+}
+
+void TorrentFileView::writeJsonString(QTextStream &out, const QString &s)
+{
+    QString ret;
+    ret.reserve(s.size() + 2);
+    ret += '"';
+    for (auto i = s.constBegin(); i != s.constEnd(); ++i)
+    {
+        switch ((*i).unicode())
+        {
+            case '"': ret += "\\\""; break;
+            case '\\': ret += "\\\\"; break;
+            case '\n': ret += "\\n"; break;
+            case '\r': ret += "\\r"; break;
+            case '\t': ret += "\\t"; break;
+            case '\b': ret += "\\b"; break;
+            case '\f': ret += "\\f"; break;
+            default:
+                if ((*i).unicode() < 0x20)
+                    ret += QString("\\u%1").arg(int((*i).unicode()), 4, 16, QChar('0'));
+                else
+                    ret += (*i);
+        }
+    }
+    ret += '"';
+    out << ret;
+}
+
+TorrentFileView::Entry TorrentFileView::find(const QList<Entry> &entries, const QString &key)
+{
+    QByteArray k = key.toUtf8();
+    for (auto i = entries.constBegin(); i != entries.constEnd(); ++i)
+        if ((*i).key == k)
+            return *i;
+    return Entry();
+}
+
+void InspectTask::run()
+{
+    TorrentFileView v;
+    for (auto i = m_files.constBegin(); i != m_files.constEnd(); ++i)
+    {
+        if (!v.open(*i))
+        {
+            infohashes << QByteArray();
+            contentkeys << QByteArray();
+            continue;
+        }
+        infohashes << v.getInfoHash();
+        QByteArray pieces = v.getPieces();
+        if (pieces.isEmpty())
+            contentkeys << QByteArray();
+        else
+        {
+            QCryptographicHash h(QCryptographicHash::Sha1);
+            h.addData(QByteArray::number(v.getPieceLength()) + ":");
+            h.addData(pieces);
+            contentkeys << h.result();
+        }
+        v.close();
+    }
+}
+
+static bool replaceStrings(QVariant& v, const QList<QPair<QString, QString> >& replace)
+{
+    bool changed = false;
+    if (v.typeId() == QMetaType::QVariantList)
+    {
+        QVariantList l = v.toList();
+        for (auto i = l.begin(); i != l.end(); ++i)
+            changed |= replaceStrings(*i, replace);
+        if (changed)
+            v = l;
+        return changed;
+    }
+
+    QString s = v.toString();
+    for (auto i = replace.constBegin(); i != replace.constEnd(); ++i)
+        s.replace((*i).first, (*i).second);
+    if (s != v.toString())
+    {
+        v = s;
+        changed = true;
+    }
+    return changed;
+}
+
+void RewriteTask::run()
+{
+    TorrentFileView v;
+    for (auto i = m_files.constBegin(); i != m_files.constEnd(); ++i)
+    {
+        oldhashes << QByteArray();
+        newhashes << QByteArray();
+        errors << QString();
+        if (!v.open(*i))
+        {
+            errors.last() = "Can't read file";
+            continue;
+        }
+
+        QMap<QByteArray, QByteArray> changes = m_changes;
+        if (!m_replace.isEmpty())
+        {
+            QList<QByteArray> keys = QList<QByteArray>() << "announce" << "announce-list";
+            for (auto k = keys.constBegin(); k != keys.constEnd(); ++k)
+            {
+                QVariant value = v.value(*k);
+                if (!changes.contains(*k) && value.isValid() && replaceStrings(value, m_replace))
+                    changes.insert(*k, TorrentFile::encodeBencode(value));
+            }
+        }
+
+        QByteArray hash;
+        QByteArray data = v.splice(changes, m_infochanges, &hash);
+        bool unchanged = data == v.raw(TorrentFileView::Span{0, v.size()});
+        oldhashes.last() = v.getInfoHash();
+        v.close();
+        if (unchanged)
+        {
+            newhashes.last() = oldhashes.last();
+            continue;
+        }
+
+        QSaveFile f(*i);
+        if (!f.open(QIODevice::WriteOnly) || f.write(data) == -1 || !f.commit())
+        {
+            errors.last() = "Can't write file";
+            continue;
+        }
+        newhashes.last() = hash;
+    }
+}
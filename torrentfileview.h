@@ -0,0 +1,155 @@
+#ifndef TORRENTFILEVIEW_H
+#define TORRENTFILEVIEW_H
+
+#include <QFile>
+#include <QVariant>
+#include <QMap>
+#include <QStringList>
+#include <QCryptographicHash>
+#include <QRunnable>
+#include <QTextStream>
+#include <QByteArrayList>
+
+
+//! Read only view on a torrent file. The file is memory mapped and only the positions of the top level and info keys are indexed, values are decoded on request. Nothing is copied until it is asked for. @sa TorrentFile::load() for a fully decoded and editable torrent.
+class TorrentFileView
+{
+public:
+    //! Byte range inside the mapped file. end points behind the last byte.
+    struct Span
+    {
+        qint64 begin = -1, end = -1;
+        bool isValid() const {return begin >= 0;}
+        qint64 size() const {return end - begin;}
+    };
+
+    //! A dictionary key and the spans of its key string and value, in file order.
+    struct Entry
+    {
+        QByteArray key;
+        Span keyspan, value;
+    };
+
+    //! Iterates the file list one entry at a time without decoding the list as a whole. Single file torrents yield exactly one entry with an empty path.
+    class FileIterator
+    {
+    public:
+        bool hasNext() const {return m_view && m_pos >= 0 && m_pos < m_end;}
+        //! Returns the path (relative to the torrents name) and the length of the next file.
+        QPair<QStringList, qint64> next();
+        //! True if the file last returned by next() is a BEP 47 padding file.
+        bool isPadding() const {return m_padding;}
+    private:
+        friend class TorrentFileView;
+        const TorrentFileView* m_view = 0;
+        qint64 m_pos = -1, m_end = -1;
+        bool m_padding = false;
+    };
+
+    TorrentFileView() {}
+    explicit TorrentFileView(const QString& filename) {open(filename);}
+    ~TorrentFileView() {close();}
+    TorrentFileView(const TorrentFileView&) = delete;
+    TorrentFileView& operator=(const TorrentFileView&) = delete;
+
+    //! Maps the file and indexes the top level and info dictionaries. @return false if the file can't be read or isn't a valid torrent.
+    bool open(const QString& filename);
+    //! Same as open() but works on data already in memory. The data is kept (implicitly shared) as long as the view is open.
+    bool openData(const QByteArray& data);
+    void close();
+    bool isValid() const {return m_infospan.isValid();}
+
+    //! Size of the whole metainfo in bytes.
+    qint64 size() const {return m_size;}
+    //! Span of the bencoded info dictionary, this is what the info hash is calculated from.
+    Span infoSpan() const {return m_infospan;}
+    //! Span of the value stored under key in the top level dictionary.
+    Span span(const QString& key) const {return find(m_entries, key).value;}
+    //! Span of the value stored under key in the info dictionary.
+    Span infoSpan(const QString& key) const {return find(m_infoentries, key).value;}
+    const QList<Entry>& entries() const {return m_entries;}
+    const QList<Entry>& infoEntries() const {return m_infoentries;}
+    //! Returns the raw bytes of a span. @warning Doesn't copy, the data is only valid as long as the view is open.
+    QByteArray raw(const Span& s) const {return s.isValid() ? QByteArray::fromRawData(m_bytes + s.begin, s.size()) : QByteArray();}
+
+    //! Decodes a single value of the top level dictionary.
+    QVariant value(const QString& key, const QVariant& defaultvalue = QVariant()) const;
+    //! Decodes a single value of the info dictionary.
+    QVariant infoValue(const QString& key, const QVariant& defaultvalue = QVariant()) const;
+    //! Decodes the value at span. Strings are decoded as QString except values of "pieces", "pieces root" and "sha1" which stay bytes.
+    QVariant decode(const Span& s) const;
+
+    QByteArray getInfoHash(bool hex = false) const;
+    QString getName() const {return infoValue("name").toString();}
+    QStringList getAnnounceUrls() const;
+    QStringList getWebseedUrls() const {return value("url-list").toStringList();}
+    qint64 getCreationDate() const {return value("creation date", 0).toLongLong();}
+    QString getComment() const {return value("comment").toString();}
+    QString getCreatedBy() const {return value("created by").toString();}
+    qint64 getPieceLength() const {return infoValue("piece length", 0).toLongLong();}
+    bool isPrivate() const {return infoValue("private", false).toBool();}
+    //! The concatenated piece hashes. @warning Doesn't copy, see raw().
+    QByteArray getPieces() const {return stringData(infoSpan("pieces"));}
+    qint64 getPieceNumber() const {return getPieces().size() / 20;}
+    //! Sum of all file lengths, reads only the length fields.
+    qint64 getContentLength() const;
+    FileIterator files() const;
+
+    //! Rebuilds the metainfo with changed top level and info keys, everything else is copied byte for byte. changes and infochanges map keys to bencoded values, an empty value removes the key. New keys are inserted at their sorted position. @param infohash is set to the info hash of the result.
+    QByteArray splice(const QMap<QByteArray, QByteArray>& changes, const QMap<QByteArray, QByteArray>& infochanges = QMap<QByteArray, QByteArray>(), QByteArray* infohash = 0) const;
+
+    //! Writes the metainfo as indented JSON to out while walking it, only the current value is ever decoded. "pieces" is written as "<stripped>", "sha1" and "pieces root" hex encoded. @param fields restricts the output to these keys: a key is looked up in the top level dictionary first, then in info ("info.<key>" forces info). "infohash" gives the hex info hash and "<list>[].<key>" selects key of every entry, e.g. "files[].path".
+    void writeJson(QTextStream& out, const QStringList& fields = QStringList()) const;
+
+    //! Returns the end of the bencoded value starting at pos or -1 if it is malformed or nests lists / dictionaries deeper than maxDepth().
+    qint64 skip(qint64 pos) const {return skip(pos, 0);}
+    //! Nesting limit of lists and dictionaries. decodeValue() and writeJsonValue() recurse only as deep as skip() accepted, so a crafted file can't exhaust the stack.
+    static int maxDepth() {return 64;}
+    //! Returns the payload of the bencoded string at s (without the length prefix). @warning Doesn't copy, see raw().
+    QByteArray stringData(const Span& s) const;
+
+private:
+    QFile m_file;
+    QByteArray m_buffer;
+    const char* m_bytes = 0;
+    qint64 m_size = 0;
+    Span m_infospan;
+    QList<Entry> m_entries, m_infoentries;
+    mutable QByteArray m_infohash;
+
+    qint64 skip(qint64 pos, int depth) const;
+    bool index();
+    bool indexDictionary(qint64 pos, QList<Entry>& entries, qint64* end) const;
+    QByteArray spliceDictionary(const QList<Entry>& entries, const QMap<QByteArray, QByteArray>& changes, qint64 sizehint) const;
+    QVariant decodeValue(qint64 pos, qint64* end, const QByteArray& key) const;
+    void writeJsonValue(QTextStream& out, qint64 pos, const QByteArray& key, int indent, const QByteArrayList& only = QByteArrayList()) const;
+    static void writeJsonString(QTextStream& out, const QString& s);
+    static Entry find(const QList<Entry>& entries, const QString& key);
+};
+
+
+//! QRunnable reimplementation to read the info hashes and content keys of a batch of torrent files. The content key is the SHA1 of the piece length and the pieces, it's the same for torrents describing the same data even if their info hash differs. Both are empty for files that can't be read.
+class InspectTask : public QRunnable
+{
+public:
+    explicit InspectTask(const QStringList& files) : m_files(files) {setAutoDelete(false);}
+    QStringList m_files;
+    QList<QByteArray> infohashes, contentkeys;
+    void run();
+};
+
+
+//! QRunnable reimplementation to rewrite a batch of torrent files in place. changes and infochanges are spliced in with TorrentFileView::splice(), replace holds substring replacements applied to the announce urls of each file. Files are replaced atomically and only if their content changed. For files that failed the new hash is empty and the error is set.
+class RewriteTask : public QRunnable
+{
+public:
+    explicit RewriteTask(const QStringList& files) : m_files(files) {setAutoDelete(false);}
+    QStringList m_files;
+    QMap<QByteArray, QByteArray> m_changes, m_infochanges;
+    QList<QPair<QString, QString> > m_replace;
+    QList<QByteArray> oldhashes, newhashes;
+    QStringList errors;
+    void run();
+};
+
+#endif // TORRENTFILEVIEW_H